@@ -1,66 +1,231 @@
 #include <algorithm>
 #include <numeric>
+#include <fstream>
+#include <cstdio>
 
 
 #include "bvh.h"
+#include "time_tools.h"
 
-BVH::BVH(Mesh *mesh) : m_mesh(mesh)
+static const char* method_name(BVH::BuildMethod method)
 {
-    indices().resize(m_mesh->nb_faces());
-    std::iota(indices().begin(), indices().end(), 0);
+    static const char *names[] = {"sweep SAH", "binned SAH", "SBVH", "LBVH", "TRBVH"};
+    return names[method];
+}
+
+BVH::BVH(Mesh *mesh, BuildMethod method, float split_budget)
+    : m_mesh(mesh), m_build_method(method), m_split_budget(split_budget), m_node_layout(BVH_NODE_LAYOUT), m_mapped_nodes(nullptr), m_mapped_indices(nullptr)
+{
+    build();
+}
+
+BVH::BVH(Mesh *mesh, BuildMethod method, const std::string &cache_path, float split_budget)
+    : m_mesh(mesh), m_build_method(method), m_split_budget(split_budget), m_node_layout(BVH_NODE_LAYOUT), m_mapped_nodes(nullptr), m_mapped_indices(nullptr)
+{
+    uint64_t mesh_hash = m_mesh->hash();
+
+    if (load(cache_path, mesh_hash))
+        return;
+
+    build();
+    save(cache_path, mesh_hash);
+}
+
+void BVH::build(void)
+{
+    Timer timer;
+
+    std::cout << "building BVH | " << m_mesh->nb_faces() << " faces | " << method_name(m_build_method) << std::endl;
+
+    if (m_build_method == SBVH)
+    {
+        build_sbvh();
+    }
+    else if (m_build_method == LBVH || m_build_method == TRBVH)
+    {
+        build_lbvh();
+    }
+    else
+    {
+        int nb_faces = m_mesh->nb_faces();
+
+        m_indices.resize(nb_faces);
+        std::iota(m_indices.begin(), m_indices.end(), 0);
+
+        // a tree over N faces has at most N - 1 inner nodes, i.e. 2N - 2 children
+        // plus the root and the padding slot, and each thread may leave the end
+        // of its last chunk unused
+        m_chunks.assign(TaskPool::global().nb_threads() + 1, NodeChunk());
+        m_nodes.resize(2 * nb_faces + m_chunks.size() * BVH_NODE_CHUNK_SIZE);
+
+        m_nodes[0] = Node(compute_face_bb(0, nb_faces), 0, nb_faces);
+
+        // slot 1 is left empty so that every sibling pair starts at an even index
+        m_nodes[1] = Node(AABB(float3(0.0f), float3(0.0f)), 0, 0);
+        m_nb_nodes = 2;
+        build_tree(0, 0, nb_faces, 0);
+        compact_nodes();
+
+        m_nb_indices = m_indices.size();
+    }
+
+    std::vector<int> old_indices;
+    relayout_nodes(m_node_layout, old_indices);
+    build_blocks();
+    record_build_costs();
+
+    m_build_time = timer.elapsed() * 1e-6;
+
+    std::cout << "BVH built in " << m_build_time << "s | " << m_nb_nodes << " nodes | SAH cost " << tree_cost() << std::endl;
+}
 
-    int end_index = m_mesh->nb_faces();
+bool BVH::load(const std::string &cache_path, uint64_t mesh_hash)
+{
+    Timer timer;
+
+    auto mapping = std::make_shared<MappedFile>(cache_path.c_str());
+    if (!mapping->is_open())
+    {
+        std::cout << "no BVH cache found at " << cache_path << std::endl;
+        return false;
+    }
 
-    AABB aabb = compute_face_bb(0, end_index);
-    m_nodes.push_back(Node(aabb, 0, end_index));
+    const CacheHeader *header = (const CacheHeader*) mapping->data();
 
-    std::cout << "building BVH | " << end_index << " faces" << std::endl;
+    bool is_valid = mapping->size() >= sizeof(CacheHeader)                           &&
+                    std::string(header->magic, 8) == std::string("rtbvh\0\0\0", 8)     &&
+                    header->version      == BVH_CACHE_VERSION                          &&
+                    header->node_size    == sizeof(Node)                               &&
+                    header->mesh_hash    == mesh_hash                                  &&
+                    header->build_method == m_build_method                             &&
+                    (m_build_method != SBVH || header->split_budget == m_split_budget) &&
+                    header->nb_faces     == m_mesh->nb_faces()                         &&
+                    mapping->size() == sizeof(CacheHeader) + header->nb_nodes * sizeof(Node) + header->nb_indices * sizeof(int);
 
-    m_nodes.resize(m_mesh->nb_faces() * 12);
+    if (!is_valid)
+    {
+        std::cout << "BVH cache " << cache_path << " is stale, rebuilding" << std::endl;
+        return false;
+    }
 
-    nb_nodes = 1;
-    build_tree(0, 0, end_index);
-    m_nodes.resize(nb_nodes);
+    m_nb_nodes       = header->nb_nodes;
+    m_nb_indices     = header->nb_indices;
+    m_mapped_nodes   = (const Node*) (mapping->data() + sizeof(CacheHeader));
+    m_mapped_indices = (const int*)  (m_mapped_nodes + m_nb_nodes);
+    m_mapping        = mapping;
 
+    build_blocks();
+    record_build_costs();
+
+    m_build_time = timer.elapsed() * 1e-6;
+
+    std::cout << "BVH mapped from " << cache_path << " in " << m_build_time << "s | " << m_nb_nodes << " nodes" << std::endl;
+
+    return true;
+}
+
+bool BVH::save(const std::string &cache_path, uint64_t mesh_hash)
+{
+    CacheHeader header;
+    std::fill((char*) &header, (char*) &header + sizeof(CacheHeader), 0);
+    std::copy_n("rtbvh\0\0\0", 8, header.magic);
+    header.version      = BVH_CACHE_VERSION;
+    header.node_size    = sizeof(Node);
+    header.mesh_hash    = mesh_hash;
+    header.build_method = m_build_method;
+    header.nb_faces     = m_mesh->nb_faces();
+    header.nb_nodes     = m_nb_nodes;
+    header.nb_indices   = m_nb_indices;
+    header.split_budget = m_split_budget;
+
+    // written next to the cache and renamed, so that a concurrent run never maps a partial file
+    std::string tmp_path = cache_path + ".tmp";
+    std::ofstream file(tmp_path.c_str(), std::ofstream::out | std::ofstream::binary);
+    file.write((const char*) &header,       sizeof(CacheHeader));
+    file.write((const char*) node_data(),  m_nb_nodes   * sizeof(Node));
+    file.write((const char*) index_data(), m_nb_indices * sizeof(int));
+    file.close();
+
+    if (!file || std::rename(tmp_path.c_str(), cache_path.c_str()) != 0)
+    {
+        std::cout << "could not write BVH cache " << cache_path << std::endl;
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+
+    std::cout << "BVH cache written to " << cache_path << std::endl;
+    return true;
+}
+
+float BVH::tree_cost(void)
+{
+    const Node *nodes = node_data();
+
+    float cost = 0.0f;
+    for (int i = 0; i < m_nb_nodes; ++i)
+    {
+        if (nodes[i].is_leaf())
+            cost += SAH_INTERSECTION_COST * nodes[i].aabb.surface() * nodes[i].count;
+        else
+            cost += SAH_TRAVERSAL_COST    * nodes[i].aabb.surface();
+    }
+    return cost / nodes[0].aabb.surface();
+}
+
+BVH::SimdRay::SimdRay(const ray &r)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        origin[i]    = v_set1(r.origin.data[i]);
+        direction[i] = v_set1(r.direction.data[i]);
+    }
 }
 
-Hit BVH::intersect(ray &r, float &t_max)
+Hit BVH::intersect(ray &r, float &t_max, TraversalStats *stats)
 {
     Hit best_hit = Hit(false, 1e32f, -1);
+    const Node *nodes = node_data();
+    SimdRay sr(r);
 
-    auto root_hit = m_nodes[0].aabb.intersect(r);
+    if (stats)
+        stats->nb_rays++;
+
+    auto root_hit = nodes[0].aabb.intersect(r);
     if (!root_hit.first)
         return best_hit;
 
-    std::vector<std::pair<int, float> > nodes_stack;
-    nodes_stack.reserve(64);
-    nodes_stack.push_back(std::make_pair(0, root_hit.second));
+    std::pair<int, float> nodes_stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    nodes_stack[stack_size++] = std::make_pair(0, root_hit.second);
 
-    while (!nodes_stack.empty())
+    while (stack_size > 0)
     {
-        auto c_pair = nodes_stack[nodes_stack.size() - 1];
-
-        nodes_stack.pop_back();
+        auto c_pair = nodes_stack[--stack_size];
 
         if (c_pair.second >= t_max)
             continue;
 
-        int    c_id = c_pair.first;
-        Node c_node = m_nodes[c_id];
+        const Node &c_node = nodes[c_pair.first];
+
+        if (stats)
+            stats->nb_nodes++;
 
         if (c_node.is_leaf())
         {
-            Hit faces_hit = intersect_faces(r, t_max, -c_node.left, -c_node.right);
+            if (stats)
+                stats->nb_faces += c_node.count;
+
+            Hit faces_hit = intersect_faces(sr, t_max, c_pair.first);
             if (faces_hit.did_hit)
                 best_hit = faces_hit;
             continue;
         }
 
-        auto  first_hit = m_nodes[ c_node.left].aabb.intersect(r);
-        auto second_hit = m_nodes[c_node.right].aabb.intersect(r);
+        int  first = c_node.offset;
+        int second = c_node.offset + 1;
 
-        int  first = c_node.left;
-        int second = c_node.right;
+        auto  first_hit = nodes[ first].aabb.intersect(r);
+        auto second_hit = nodes[second].aabb.intersect(r);
 
         if (first_hit.first && second_hit.first && first_hit.second > second_hit.second)
         {
@@ -69,102 +234,187 @@ Hit BVH::intersect(ray &r, float &t_max)
         }
 
         if (second_hit.second < t_max)
-            nodes_stack.push_back(std::make_pair(second, second_hit.second));
+            nodes_stack[stack_size++] = std::make_pair(second, second_hit.second);
 
         if (first_hit.second < t_max)
-            nodes_stack.push_back(std::make_pair(first, first_hit.second));
+            nodes_stack[stack_size++] = std::make_pair(first, first_hit.second);
     }
 
     return best_hit;
 }
 
-bool BVH::visibility(ray &r, float t_max)
+// the children are pushed in memory order without their distances, any face
+// closer than t_max ends the walk
+bool BVH::visibility(ray &r, float t_max, TraversalStats *stats, Hit *occluder)
 {
-    auto root_hit = m_nodes[0].aabb.intersect(r);
-    if (!root_hit.first)
-        return false;
+    const Node *nodes = node_data();
+    SimdRay sr(r);
 
-    std::vector<std::pair<int, float> > nodes_stack;
-    nodes_stack.reserve(64);
-    nodes_stack.push_back(std::make_pair(0, root_hit.second));
+    if (stats)
+        stats->nb_rays++;
 
-    while (!nodes_stack.empty())
-    {
-        auto c_pair = nodes_stack[nodes_stack.size() - 1];
+    auto root_hit = nodes[0].aabb.intersect(r);
+    if (!root_hit.first || root_hit.second > t_max)
+        return false;
 
-        nodes_stack.pop_back();
+    int nodes_stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    nodes_stack[stack_size++] = 0;
 
-        if (c_pair.second > t_max)
-            continue;
+    while (stack_size > 0)
+    {
+        int c_id = nodes_stack[--stack_size];
+        const Node &c_node = nodes[c_id];
 
-        int    c_id = c_pair.first;
-        Node c_node = m_nodes[c_id];
+        if (stats)
+            stats->nb_nodes++;
 
         if (c_node.is_leaf())
         {
-            bool faces_hit = intersect_faces_ea(r, t_max, -c_node.left, -c_node.right);
-            if (faces_hit)
+            if (stats)
+                stats->nb_faces += c_node.count;
+
+            Hit hit = intersect_faces_ea(sr, t_max, c_id);
+            if (hit)
+            {
+                if (occluder)
+                    *occluder = hit;
                 return true;
+            }
             continue;
         }
 
-        auto  first_hit = m_nodes[ c_node.left].aabb.intersect(r);
-        auto second_hit = m_nodes[c_node.right].aabb.intersect(r);
-
-        int  first = c_node.left;
-        int second = c_node.right;
-
-        if (first_hit.first && second_hit.first && first_hit.second > second_hit.second)
+        for (int k = 1; k >= 0; --k)
         {
-            std::swap(first,     second);
-            std::swap(first_hit, second_hit);
+            auto child_hit = nodes[c_node.offset + k].aabb.intersect(r);
+            if (child_hit.first && child_hit.second <= t_max)
+                nodes_stack[stack_size++] = c_node.offset + k;
         }
-
-        if (second_hit.second <= t_max)
-            nodes_stack.push_back(std::make_pair(second, second_hit.second));
-
-        if (first_hit.second <= t_max)
-            nodes_stack.push_back(std::make_pair(first, first_hit.second));
     }
 
     return false;
 }
 
-Hit BVH::intersect_faces(ray &r, float &t_max, int start_index, int end_index)
+// lanes are scanned in face order with a strict test, so that ties keep the
+// first face like the scalar loop did
+Hit BVH::intersect_faces(const SimdRay &r, float &t_max, int node_index)
 {
+    const TriangleBlock *block = &m_blocks[m_leaf_blocks[node_index]];
+    int nb_blocks = node_data()[node_index].nb_blocks();
+
     Hit hit(false, 1e32f, -1);
-    for (int ii = start_index; ii < end_index; ++ii)
+    alignas(32) float t[SIMD_WIDTH];
+
+    for (int b = 0; b < nb_blocks; ++b, ++block)
     {
-        int i = m_indices[ii];
-        auto trit = m_mesh->triangle(i).intersect(r);
-        if (trit.first && trit.second < hit.t && trit.second < t_max)
+        vfloat v0[3] = {v_load(block->v0[0]), v_load(block->v0[1]), v_load(block->v0[2])};
+        vfloat e0[3] = {v_load(block->e0[0]), v_load(block->e0[1]), v_load(block->e0[2])};
+        vfloat e1[3] = {v_load(block->e1[0]), v_load(block->e1[1]), v_load(block->e1[2])};
+
+        vfloat vt;
+        vfloat hits = intersect_triangle_lanes(r.origin, r.direction, v0, e0, e1, vt);
+        int mask = v_mask(v_and(hits, v_lt(vt, v_set1(t_max))));
+        if (!mask)
+            continue;
+
+        v_store(t, vt);
+        for (; mask; mask &= mask - 1)
         {
-            hit.did_hit = true;
-            hit.face_id = i;
-            hit.t = trit.second;
-            t_max = hit.t;
+            int k = __builtin_ctz(mask);
+            if (t[k] < t_max)
+            {
+                hit   = Hit(true, t[k], block->face_id[k]);
+                t_max = t[k];
+            }
         }
     }
     return hit;
 }
 
-bool BVH::intersect_faces_ea(ray &r, float &t_max, int start_index, int end_index)
+// first face of the leaf closer than t_max, with its distance
+Hit BVH::intersect_faces_ea(const SimdRay &r, float t_max, int node_index)
 {
-    for (int ii = start_index; ii < end_index; ++ii)
+    const TriangleBlock *block = &m_blocks[m_leaf_blocks[node_index]];
+    int nb_blocks = node_data()[node_index].nb_blocks();
+
+    for (int b = 0; b < nb_blocks; ++b, ++block)
     {
-        int i = m_indices[ii];
-        auto trit = m_mesh->triangle(i).intersect(r);
-        if (trit.first && trit.second <= t_max)
+        vfloat v0[3] = {v_load(block->v0[0]), v_load(block->v0[1]), v_load(block->v0[2])};
+        vfloat e0[3] = {v_load(block->e0[0]), v_load(block->e0[1]), v_load(block->e0[2])};
+        vfloat e1[3] = {v_load(block->e1[0]), v_load(block->e1[1]), v_load(block->e1[2])};
+
+        vfloat vt;
+        vfloat hits = intersect_triangle_lanes(r.origin, r.direction, v0, e0, e1, vt);
+        int mask = v_mask(v_and(hits, v_le(vt, v_set1(t_max))));
+        if (mask)
         {
-            t_max = trit.second;
-            return true;
+            alignas(32) float t[SIMD_WIDTH];
+            v_store(t, vt);
+
+            int lane = __builtin_ctz(mask);
+            return Hit(true, t[lane], block->face_id[lane]);
         }
     }
-    return false;
+    return Hit(false, 1e32f, -1);
+}
+
+void BVH::build_blocks(void)
+{
+    const Node *nodes   = node_data();
+    const int  *indices = index_data();
+
+    m_leaf_blocks.assign(m_nb_nodes, -1);
+
+    int nb_blocks = 0;
+    for (int i = 0; i < m_nb_nodes; ++i)
+    {
+        if (nodes[i].is_leaf())
+        {
+            m_leaf_blocks[i] = nb_blocks;
+            nb_blocks += nodes[i].nb_blocks();
+        }
+    }
+
+    m_blocks.resize(nb_blocks);
+
+    TaskPool::global().parallel_for(0, m_nb_nodes, BVH_PARALLEL_GRAIN, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            if (!nodes[i].is_leaf())
+                continue;
+
+            TriangleBlock *block = &m_blocks[m_leaf_blocks[i]];
+            for (int f = 0; f < nodes[i].nb_blocks() * SIMD_WIDTH; ++f)
+            {
+                TriangleBlock &b = block[f / SIMD_WIDTH];
+                int k = f % SIMD_WIDTH;
+
+                Triangle tri(float3(0.0f), float3(0.0f), float3(0.0f));
+                b.face_id[k] = -1;
+                if (f < nodes[i].count)
+                {
+                    b.face_id[k] = indices[nodes[i].offset + f];
+                    tri = m_mesh->triangle(b.face_id[k]);
+                }
+
+                float3 e0 = tri.v1 - tri.v0;
+                float3 e1 = tri.v2 - tri.v0;
+                for (int a = 0; a < 3; ++a)
+                {
+                    b.v0[a][k] = tri.v0.data[a];
+                    b.e0[a][k] = e0.data[a];
+                    b.e1[a][k] = e1.data[a];
+                }
+            }
+        }
+    });
 }
 
 AABB BVH::compute_face_bb(int start_index, int end_index)
 {
+    if (end_index - start_index > BVH_PARALLEL_THRESHOLD)
+        return parallel_bb(start_index, end_index, &BVH::compute_face_bb);
+
     float3 bb_min( 1e32f);
     float3 bb_max(-1e32f);
 
@@ -179,6 +429,9 @@ AABB BVH::compute_face_bb(int start_index, int end_index)
 
 AABB BVH::compute_centroid_bb(int start_index, int end_index)
 {
+    if (end_index - start_index > BVH_PARALLEL_THRESHOLD)
+        return parallel_bb(start_index, end_index, &BVH::compute_centroid_bb);
+
     float3 bb_min( 1e32f);
     float3 bb_max(-1e32f);
 
@@ -192,47 +445,93 @@ AABB BVH::compute_centroid_bb(int start_index, int end_index)
     return AABB(bb_min, bb_max);
 }
 
+AABB BVH::parallel_bb(int start_index, int end_index, AABB (BVH::*compute_bb)(int, int))
+{
+    int nb_blocks = (end_index - start_index + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+    std::vector<AABB> block_bbs(nb_blocks);
+
+    TaskPool::global().parallel_for(start_index, end_index, BVH_PARALLEL_GRAIN, [&](int begin, int end) {
+        block_bbs[(begin - start_index) / BVH_PARALLEL_GRAIN] = (this->*compute_bb)(begin, end);
+    });
+
+    AABB bb = block_bbs[0];
+    for (int b = 1; b < nb_blocks; ++b)
+        bb.extend(block_bbs[b]);
+    return bb;
+}
+
 void BVH::sort(int start_index, int end_index, int axis)
 {
     std::sort(m_indices.begin() + start_index, m_indices.begin() + end_index, face_comparator(m_mesh, axis));
 }
 
+// leaves the range sorted along the best axis
 std::pair<int, int> BVH::choose_split(int start_index, int end_index)
 {
-    std::pair<float, int> best_split(1e32f, -1);
-    int best_axis = -1;
-    for (int i = 0; i < 3; ++i)
+    int nb_faces = end_index - start_index;
+
+    std::pair<float, int> splits[3];
+    int best_axis = 0;
+
+    // large nodes sort and sweep the three axes concurrently, on copies of the range
+    if (nb_faces > BVH_PARALLEL_THRESHOLD)
+    {
+        std::vector<int> sorted[3];
+
+        TaskGroup group;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            group.run([&, axis]() {
+                sorted[axis].assign(m_indices.begin() + start_index, m_indices.begin() + end_index);
+                splits[axis] = sah_cost(sorted[axis].data(), nb_faces, axis);
+            });
+        }
+        group.wait();
+
+        for (int axis = 1; axis < 3; ++axis)
+        {
+            if (splits[axis].first < splits[best_axis].first)
+                best_axis = axis;
+        }
+
+        std::copy(sorted[best_axis].begin(), sorted[best_axis].end(), m_indices.begin() + start_index);
+    }
+    else
     {
-        auto current_split = sah_cost(start_index, end_index, i);
-        if (current_split.first < best_split.first)
+        for (int axis = 0; axis < 3; ++axis)
         {
-            best_split = current_split;
-            best_axis  = i;
+            splits[axis] = sah_cost(m_indices.data() + start_index, nb_faces, axis);
+            if (splits[axis].first < splits[best_axis].first)
+                best_axis = axis;
         }
+
+        if (best_axis != 2)
+            sort(start_index, end_index, best_axis);
     }
-    return std::make_pair(best_split.second, best_axis);
+
+    return std::make_pair(start_index + splits[best_axis].second, best_axis);
 }
 
-std::pair<float, int> BVH::sah_cost(int start_index, int end_index, int axis)
+// sorts indices along axis and returns the best SAH cost and split offset
+std::pair<float, int> BVH::sah_cost(int *indices, int nb_faces, int axis)
 {
-    sort(start_index, end_index, axis);
+    std::sort(indices, indices + nb_faces, face_comparator(m_mesh, axis));
 
-    int nb_faces = end_index - start_index;
     std::vector<float>  left_surfaces(nb_faces - 1);
     std::vector<float> right_surfaces(nb_faces - 1);
 
-    AABB left_aabb = m_mesh->triangle(m_indices[start_index]).bb();
+    AABB left_aabb = m_mesh->triangle(indices[0]).bb();
     left_surfaces[0] = left_aabb.surface();
 
-    AABB right_aabb = m_mesh->triangle(m_indices[end_index - 1]).bb();
+    AABB right_aabb = m_mesh->triangle(indices[nb_faces - 1]).bb();
     right_surfaces[0] = right_aabb.surface();
 
     for (int i = 1; i < nb_faces - 1; ++i)
     {
-        AABB face_aabb = m_mesh->triangle(m_indices[start_index + i]).bb();
+        AABB face_aabb = m_mesh->triangle(indices[i]).bb();
         left_aabb.extend(face_aabb);
 
-        face_aabb = m_mesh->triangle(m_indices[end_index - 1 - i]).bb();
+        face_aabb = m_mesh->triangle(indices[nb_faces - 1 - i]).bb();
         right_aabb.extend(face_aabb);
 
         left_surfaces[i]  =  left_aabb.surface();
@@ -252,7 +551,7 @@ std::pair<float, int> BVH::sah_cost(int start_index, int end_index, int axis)
         }
     }
 
-    return std::make_pair(min_cost, start_index + min_id);
+    return std::make_pair(min_cost, min_id);
 
 
     //    int split_index = nb_faces / 2;
@@ -262,54 +561,326 @@ std::pair<float, int> BVH::sah_cost(int start_index, int end_index, int axis)
     //    return std::make_pair(cost, start_index + split_index);
 }
 
-void BVH::build_tree(int current_node, int start_index, int end_index)
+void BVH::SahBins::clear(void)
 {
-    //std::cout << "node " << current_node << " | " << std::flush;
-    if (end_index - start_index > MAX_FACES_PER_LEAF)
+    for (int axis = 0; axis < 3; ++axis)
     {
-        auto best_split  = choose_split(start_index, end_index);
-        int  split_index = best_split.first;
+        for (int b = 0; b < NB_SAH_BINS; ++b)
+        {
+            bb[axis][b]    = AABB(float3(1e32f), float3(-1e32f));
+            count[axis][b] = 0;
+        }
+    }
+}
 
-        sort(start_index, end_index, best_split.second);
+void BVH::SahBins::merge(const SahBins &bins)
+{
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        for (int b = 0; b < NB_SAH_BINS; ++b)
+        {
+            bb[axis][b].extend(bins.bb[axis][b]);
+            count[axis][b] += bins.count[axis][b];
+        }
+    }
+}
+
+static inline int bin_index(const float3 &c, const AABB &centroid_bb, const float3 &scale, int axis)
+{
+    int b = (int) ((c.data[axis] - centroid_bb.mini.data[axis]) * scale.data[axis]);
+    return std::min(b, NB_SAH_BINS - 1);
+}
 
-        //std::cout << "splitting: " << axes[best_split.second] << " | " << std::flush;
+void BVH::bin_faces(int start_index, int end_index, const AABB &centroid_bb, const float3 &scale, SahBins &bins)
+{
+    bins.clear();
 
-        AABB left_aabb  = compute_face_bb(start_index, split_index);
-        AABB right_aabb = compute_face_bb(split_index, end_index);
+    for (int ii = start_index; ii < end_index; ++ii)
+    {
+        int    i    = m_indices[ii];
+        AABB   f_bb = m_mesh->triangle(i).bb();
+        float3 c    = m_mesh->centroid(i);
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            int b = bin_index(c, centroid_bb, scale, axis);
+            bins.bb[axis][b].extend(f_bb);
+            bins.count[axis][b]++;
+        }
+    }
+}
+
+// std::partition of m_indices, large ranges count the faces of each block going
+// left, then scatter the blocks to a buffer at their prefix offsets
+template <typename Predicate>
+int BVH::partition(int start_index, int end_index, Predicate predicate)
+{
+    int nb_faces = end_index - start_index;
+    if (nb_faces <= BVH_PARALLEL_THRESHOLD)
+        return std::partition(m_indices.begin() + start_index, m_indices.begin() + end_index, predicate) - m_indices.begin();
+
+    TaskPool &pool = TaskPool::global();
+
+    int nb_blocks = (nb_faces + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+    std::vector<int> nb_left(nb_blocks);
+
+    pool.parallel_for(start_index, end_index, BVH_PARALLEL_GRAIN, [&](int begin, int end) {
+        int count = 0;
+        for (int ii = begin; ii < end; ++ii)
+            count += predicate(m_indices[ii]);
+        nb_left[(begin - start_index) / BVH_PARALLEL_GRAIN] = count;
+    });
+
+    std::vector<int> left_offsets(nb_blocks), right_offsets(nb_blocks);
+    int total_left = 0;
+    for (int b = 0; b < nb_blocks; ++b)
+    {
+        left_offsets[b] = total_left;
+        total_left     += nb_left[b];
+    }
+    int total_right = 0;
+    for (int b = 0; b < nb_blocks; ++b)
+    {
+        right_offsets[b] = total_left + total_right;
+        total_right     += std::min(BVH_PARALLEL_GRAIN, nb_faces - b * BVH_PARALLEL_GRAIN) - nb_left[b];
+    }
+
+    std::vector<int> buffer(nb_faces);
+
+    pool.parallel_for(start_index, end_index, BVH_PARALLEL_GRAIN, [&](int begin, int end) {
+        int b     = (begin - start_index) / BVH_PARALLEL_GRAIN;
+        int left  = left_offsets[b];
+        int right = right_offsets[b];
+        for (int ii = begin; ii < end; ++ii)
+        {
+            int i = m_indices[ii];
+            if (predicate(i))
+                buffer[left++]  = i;
+            else
+                buffer[right++] = i;
+        }
+    });
+
+    pool.parallel_for(start_index, end_index, BVH_PARALLEL_GRAIN, [&](int begin, int end) {
+        std::copy(buffer.begin() + (begin - start_index), buffer.begin() + (end - start_index), m_indices.begin() + begin);
+    });
+
+    return start_index + total_left;
+}
+
+// bins the centroids on all three axes in a single pass, evaluates the SAH
+// at the NB_SAH_BINS - 1 bin boundaries and partitions m_indices in place,
+// large nodes bin blocks of faces in parallel and merge the bins
+int BVH::binned_split(int start_index, int end_index)
+{
+    AABB   centroid_bb = compute_centroid_bb(start_index, end_index);
+    float3 extent      = centroid_bb.maxi - centroid_bb.mini;
+
+    float3 scale;
+    for (int axis = 0; axis < 3; ++axis)
+        scale.data[axis] = extent.data[axis] > 0.0f ? NB_SAH_BINS / extent.data[axis] : 0.0f;
+
+    SahBins sah_bins;
+
+    int nb_faces = end_index - start_index;
+    if (nb_faces > BVH_PARALLEL_THRESHOLD)
+    {
+        int nb_blocks = (nb_faces + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+        std::vector<SahBins> block_bins(nb_blocks);
+
+        TaskPool::global().parallel_for(start_index, end_index, BVH_PARALLEL_GRAIN, [&](int begin, int end) {
+            bin_faces(begin, end, centroid_bb, scale, block_bins[(begin - start_index) / BVH_PARALLEL_GRAIN]);
+        });
 
-        //std::cout << " l, s, r: " << start_index << ", " << split_index << ", " << end_index << std::endl;
+        sah_bins.clear();
+        for (auto &bins : block_bins)
+            sah_bins.merge(bins);
+    }
+    else
+    {
+        bin_faces(start_index, end_index, centroid_bb, scale, sah_bins);
+    }
 
+    auto &bins   = sah_bins.bb;
+    auto &counts = sah_bins.count;
+
+    float best_cost = 1e32f;
+    int   best_axis = -1;
+    int   best_bin  = -1;
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (extent.data[axis] <= 0.0f)
+            continue;
 
-        int left_index = __sync_fetch_and_add(&nb_nodes, 2);
-        //int left_index = nb_nodes;
-        // nb_nodes += 2;
+        float right_surfaces[NB_SAH_BINS];
+        int   right_counts[NB_SAH_BINS];
+
+        AABB right_aabb(float3(1e32f), float3(-1e32f));
+        int  right_count = 0;
+        for (int b = NB_SAH_BINS - 1; b > 0; --b)
+        {
+            right_aabb.extend(bins[axis][b]);
+            right_count += counts[axis][b];
+            right_surfaces[b] = right_count > 0 ? right_aabb.surface() : 0.0f;
+            right_counts[b]   = right_count;
+        }
+
+        AABB left_aabb(float3(1e32f), float3(-1e32f));
+        int  left_count = 0;
+        for (int b = 1; b < NB_SAH_BINS; ++b)
+        {
+            left_aabb.extend(bins[axis][b - 1]);
+            left_count += counts[axis][b - 1];
+
+            if (left_count == 0 || right_counts[b] == 0)
+                continue;
+
+            float current_cost = left_aabb.surface() * left_count + right_surfaces[b] * right_counts[b];
+            if (current_cost < best_cost)
+            {
+                best_cost = current_cost;
+                best_axis = axis;
+                best_bin  = b;
+            }
+        }
+    }
+
+    // all the centroids fall in a single bin
+    if (best_axis < 0)
+        return median_split(start_index, end_index);
+
+    return partition(start_index, end_index, [&](int i) {
+        return bin_index(m_mesh->centroid(i), centroid_bb, scale, best_axis) < best_bin;
+    });
+}
+
+int BVH::median_split(int start_index, int end_index)
+{
+    AABB   centroid_bb = compute_centroid_bb(start_index, end_index);
+    float3 extent      = centroid_bb.maxi - centroid_bb.mini;
+
+    int axis        = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    int split_index = (start_index + end_index) / 2;
+
+    std::nth_element(m_indices.begin() + start_index, m_indices.begin() + split_index, m_indices.begin() + end_index, face_comparator(m_mesh, axis));
+
+    return split_index;
+}
+
+void BVH::build_tree(int current_node, int start_index, int end_index, int depth)
+{
+    //std::cout << "node " << current_node << " | " << std::flush;
+    if (end_index - start_index > MAX_FACES_PER_LEAF)
+    {
+        // past MAX_SAH_DEPTH median splits bound the depth, and so the traversal stack
+        int split_index;
+        if (depth >= MAX_SAH_DEPTH)
+        {
+            split_index = median_split(start_index, end_index);
+        }
+        else if (m_build_method == BINNED_SAH)
+        {
+            split_index = binned_split(start_index, end_index);
+        }
+        else
+        {
+            split_index = choose_split(start_index, end_index).first;
+        }
 
-        m_nodes[left_index    ] = Node(left_aabb,  -1, -1);
-        m_nodes[left_index + 1] = Node(right_aabb, -1, -1);
+        AABB left_aabb  = compute_face_bb(start_index, split_index);
+        AABB right_aabb = compute_face_bb(split_index, end_index);
 
+        int left_index = allocate_nodes();
 
-        m_nodes[current_node].left  = left_index;
-        m_nodes[current_node].right = left_index + 1;
+        m_nodes[left_index    ] = Node(left_aabb,  -1, 0);
+        m_nodes[left_index + 1] = Node(right_aabb, -1, 0);
 
+        m_nodes[current_node].offset = left_index;
+        m_nodes[current_node].count  = 0;
 
-        if (end_index - start_index > m_mesh->nb_faces() / 12)
+        if (end_index - start_index > BVH_TASK_THRESHOLD)
         {
-            auto left = std::async(std::launch::async, [&]() {
-                return build_tree(left_index    , start_index, split_index);
+            TaskGroup group;
+            group.run([=]() {
+                build_tree(left_index, start_index, split_index, depth + 1);
             });
-            build_tree(left_index + 1, split_index,   end_index);
+            build_tree(left_index + 1, split_index, end_index, depth + 1);
+            group.wait();
         }
         else
         {
-            build_tree(left_index    , start_index, split_index);
-            build_tree(left_index + 1, split_index,   end_index);
+            build_tree(left_index    , start_index, split_index, depth + 1);
+            build_tree(left_index + 1, split_index,   end_index, depth + 1);
         }
 
     }
     else
     {
         //std::cout << "leaf node: " << start_index << ", " << end_index << " with " << end_index - start_index << " vertices" << std::endl;
-        m_nodes[current_node].left  = -start_index;
-        m_nodes[current_node].right = -end_index;
+        m_nodes[current_node].offset = start_index;
+        m_nodes[current_node].count  = end_index - start_index;
+    }
+}
+
+// returns the index of a free sibling pair, taken from the calling thread's chunk
+int BVH::allocate_nodes(void)
+{
+    NodeChunk &chunk = m_chunks[TaskPool::global().thread_index()];
+
+    if (chunk.next == chunk.end)
+    {
+        chunk.next = __sync_fetch_and_add(&m_nb_nodes, BVH_NODE_CHUNK_SIZE);
+        chunk.end  = chunk.next + BVH_NODE_CHUNK_SIZE;
     }
+
+    int index = chunk.next;
+    chunk.next += 2;
+    return index;
+}
+
+// closes the gaps left at the end of the chunks and shrinks m_nodes to the
+// exact node count, gaps have an even size so sibling pairs stay aligned
+void BVH::compact_nodes(void)
+{
+    std::vector<std::pair<int, int> > gaps;
+    for (auto &chunk : m_chunks)
+    {
+        if (chunk.next < chunk.end)
+            gaps.push_back(std::make_pair(chunk.next, chunk.end));
+    }
+    std::sort(gaps.begin(), gaps.end());
+
+    std::vector<int> gap_ends, shifts;
+    int nb_nodes = gaps.empty() ? m_nb_nodes : gaps[0].first;
+    int shift    = 0;
+    for (size_t k = 0; k < gaps.size(); ++k)
+    {
+        int next_gap = k + 1 < gaps.size() ? gaps[k + 1].first : m_nb_nodes;
+        std::copy(m_nodes.begin() + gaps[k].second, m_nodes.begin() + next_gap, m_nodes.begin() + nb_nodes);
+        nb_nodes += next_gap - gaps[k].second;
+
+        shift += gaps[k].second - gaps[k].first;
+        gap_ends.push_back(gaps[k].second);
+        shifts.push_back(shift);
+    }
+
+    if (!gaps.empty())
+    {
+        TaskPool::global().parallel_for(0, nb_nodes, BVH_PARALLEL_GRAIN, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                Node &node = m_nodes[i];
+                if (i == 1 || node.is_leaf())
+                    continue;
+
+                int k = std::upper_bound(gap_ends.begin(), gap_ends.end(), node.offset) - gap_ends.begin();
+                if (k > 0)
+                    node.offset -= shifts[k - 1];
+            }
+        });
+    }
+
+    m_nb_nodes = nb_nodes;
+    NodeVector(m_nodes.begin(), m_nodes.begin() + m_nb_nodes).swap(m_nodes);
+    m_chunks.clear();
 }
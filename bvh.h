@@ -2,28 +2,256 @@
 #define BVH_H
 
 #define MAX_FACES_PER_LEAF 8
+#define NB_SAH_BINS        32
+#define NB_SPATIAL_BINS    32
+#define MAX_SAH_DEPTH      32
+#define BVH_STACK_SIZE     64
+
+// subtrees of more than BVH_TASK_THRESHOLD faces are built as separate tasks,
+// nodes of more than BVH_PARALLEL_THRESHOLD faces also bin and partition their
+// faces in parallel blocks of BVH_PARALLEL_GRAIN faces
+#define BVH_TASK_THRESHOLD     4096
+#define BVH_PARALLEL_THRESHOLD 65536
+#define BVH_PARALLEL_GRAIN     16384
+#define BVH_NODE_CHUNK_SIZE    256
+
+// refit: subtrees above BVH_REFIT_TASK_DEPTH are refitted as separate tasks, a
+// subtree is rebuilt once its normalized SAH cost exceeds its build-time cost
+// times the rebuild threshold (BVH_REBUILD_THRESHOLD by default in the renderer)
+#define BVH_REFIT_TASK_DEPTH   8
+#define BVH_REBUILD_THRESHOLD  1.5f
+
+#define SAH_TRAVERSAL_COST    1.0f
+#define SAH_INTERSECTION_COST 1.0f
+
+// SBVH: fraction of extra face references spatial splits may create, and
+// minimal child overlap (relative to the root surface) to try one
+#define SBVH_SPLIT_BUDGET       0.3f
+#define SBVH_OVERLAP_THRESHOLD  1e-5f
+
+// LBVH: faces sorted by Morton codes of LBVH_MORTON_BITS per axis with a radix
+// sort of LBVH_RADIX_BITS per pass, leaves of up to LBVH_MAX_FACES_PER_LEAF
+// faces; TRBVH then restructures treelets of up to LBVH_TREELET_SIZE leaves
+#define LBVH_MORTON_BITS        21
+#define LBVH_RADIX_BITS         8
+#define LBVH_MAX_FACES_PER_LEAF 4
+#define LBVH_TREELET_SIZE       7
+
+// default order of the nodes after a build or a partial rebuild, see BVH::reorder_nodes
+#define BVH_NODE_LAYOUT BVH::DEPTH_FIRST
+
+#define BVH_CACHE_VERSION 2
+
+// primary rays are traced in packets of RAY_PACKET_WIDTH x RAY_PACKET_HEIGHT
+// pixels, RAY_PACKET_SIZE must be a multiple of the SIMD width
+#define RAY_PACKET_WIDTH  4
+#define RAY_PACKET_HEIGHT 4
+#define RAY_PACKET_SIZE   (RAY_PACKET_WIDTH * RAY_PACKET_HEIGHT)
 
 #include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
 #include <utility>
 #include <algorithm>
-#include <thread>
-#include <atomic>
-#include <future>
+#include <cstring>
 
 #include "math_tools.h"
+#include "memory_tools.h"
 #include "geometry.h"
 #include "mesh.h"
+#include "file_tools.h"
+#include "task_pool.h"
+#include "simd_tools.h"
+
+// same as the epsilon of Triangle::intersect
+#define TRIANGLE_EPSILON 1e-10f
+
+struct TraversalStats
+{
+    TraversalStats() : nb_rays(0), nb_nodes(0), nb_faces(0), nb_shadow_rays(0), nb_occluder_hits(0) {}
+
+    long long nb_rays;
+    long long nb_nodes;
+    long long nb_faces;
+
+    // counted by the renderer, shadow rays blocked by the cached occluder skip the traversal
+    long long nb_shadow_rays;
+    long long nb_occluder_hits;
+
+    inline TraversalStats& operator+=(const TraversalStats &s)
+    {
+        nb_rays += s.nb_rays; nb_nodes += s.nb_nodes; nb_faces += s.nb_faces;
+        nb_shadow_rays += s.nb_shadow_rays; nb_occluder_hits += s.nb_occluder_hits;
+        return *this;
+    }
+};
+
+// rays of a packet stored as SoA, lanes without a ray are cleared from active
+struct alignas(32) RayPacket
+{
+    RayPacket() { std::memset(this, 0, sizeof(RayPacket)); }
+
+    float origin[3][RAY_PACKET_SIZE];
+    float direction[3][RAY_PACKET_SIZE];
+    float inv_d[3][RAY_PACKET_SIZE];
+    int   active;
+
+    inline void set(int k, const ray &r)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            origin[a][k]    = r.origin.data[a];
+            direction[a][k] = r.direction.data[a];
+            inv_d[a][k]     = r.inv_d.data[a];
+        }
+        active |= 1 << k;
+    }
+
+    inline ray get(int k) const
+    {
+        return ray(float3(origin[0][k], origin[1][k], origin[2][k]), float3(direction[0][k], direction[1][k], direction[2][k]));
+    }
+};
+
+// a ray of a stream, its first 8 floats transpose with those of 3 other rays
+// into SSE registers of origins, t and inverse directions
+struct alignas(16) StreamRay
+{
+    float origin[3];
+    float t;        // t_max, then the closest hit
+    float inv_d[3];
+    int   face_id;  // -1 until a face is hit
+    float direction[3];
+
+    inline void set(const ray &r, float t_max)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            origin[a]    = r.origin.data[a];
+            inv_d[a]     = r.inv_d.data[a];
+            direction[a] = r.direction.data[a];
+        }
+        t       = t_max;
+        face_id = -1;
+    }
+};
+
+// the Moller-Trumbore test of Triangle::intersect on SIMD_WIDTH lanes, which
+// hold either different rays or different triangles; returns the mask of the
+// lanes hit in front of the origin, and their distances in t
+inline vfloat intersect_triangle_lanes(const vfloat *o, const vfloat *d, const vfloat *v0, const vfloat *e0, const vfloat *e1, vfloat &t)
+{
+    vfloat eps  = v_set1(TRIANGLE_EPSILON);
+    vfloat one  = v_set1(1.0f);
+    vfloat zero = v_set1(0.0f);
+
+    vfloat px = v_sub(v_mul(d[1], e1[2]), v_mul(d[2], e1[1]));
+    vfloat py = v_sub(v_mul(d[2], e1[0]), v_mul(d[0], e1[2]));
+    vfloat pz = v_sub(v_mul(d[0], e1[1]), v_mul(d[1], e1[0]));
+
+    vfloat det     = v_add(v_add(v_mul(px, e0[0]), v_mul(py, e0[1])), v_mul(pz, e0[2]));
+    vfloat inv_det = v_div(one, det);
+
+    vfloat tx = v_sub(o[0], v0[0]);
+    vfloat ty = v_sub(o[1], v0[1]);
+    vfloat tz = v_sub(o[2], v0[2]);
+
+    vfloat u = v_mul(v_add(v_add(v_mul(px, tx), v_mul(py, ty)), v_mul(pz, tz)), inv_det);
+
+    vfloat qx = v_sub(v_mul(ty, e0[2]), v_mul(tz, e0[1]));
+    vfloat qy = v_sub(v_mul(tz, e0[0]), v_mul(tx, e0[2]));
+    vfloat qz = v_sub(v_mul(tx, e0[1]), v_mul(ty, e0[0]));
+
+    vfloat v = v_mul(v_add(v_add(v_mul(qx, d[0]),  v_mul(qy, d[1])),  v_mul(qz, d[2])),  inv_det);
+    t        = v_mul(v_add(v_add(v_mul(qx, e1[0]), v_mul(qy, e1[1])), v_mul(qz, e1[2])), inv_det);
+
+    // the rejections of the scalar test, so that NaNs only fail at t > epsilon
+    vfloat hit = v_gt(t, eps);
+    hit = v_andnot(v_and(v_gt(det, v_set1(-TRIANGLE_EPSILON)), v_lt(det, eps)), hit);
+    hit = v_andnot(v_or(v_lt(u, zero), v_gt(u, one)), hit);
+    hit = v_andnot(v_or(v_lt(v, zero), v_gt(v_add(u, v), one)), hit);
+    return hit;
+}
 
 class BVH
 {
-    struct Node
+    // children are allocated in pairs at even indices of a 64 byte aligned
+    // array, so both siblings of a node share one cache line
+    struct alignas(32) Node
     {
         Node() {}
-        Node(AABB aabb, int l, int r) : aabb(aabb), left(l), right(r) {}
+        Node(AABB aabb, int offset, int count) : aabb(aabb), offset(offset), count(count) {}
         AABB aabb;
-        int left, right;
+        int  offset; // left child index (the right one is offset + 1), or first face index of a leaf
+        int  count;  // number of faces of a leaf, 0 for inner nodes
+
+        inline bool is_leaf(void)   const { return count > 0; }
+        inline int  nb_blocks(void) const { return (count + SIMD_WIDTH - 1) / SIMD_WIDTH; }
+    };
+
+    // nodes, then indices, follow the header in a cache file
+    struct CacheHeader
+    {
+        char     magic[8];
+        uint32_t version;
+        uint32_t node_size;
+        uint64_t mesh_hash;
+        int32_t  build_method;
+        int32_t  nb_faces;
+        int32_t  nb_nodes;
+        int32_t  nb_indices;
+        float    split_budget;
+        char     padding[20];
+    };
+
+    // per-axis SAH bins of the binned builder
+    struct SahBins
+    {
+        AABB bb[3][NB_SAH_BINS];
+        int  count[3][NB_SAH_BINS];
+
+        void clear(void);
+        void merge(const SahBins &bins);
+    };
+
+    // range of node slots owned by one builder thread, padded to a cache line
+    struct alignas(64) NodeChunk
+    {
+        NodeChunk() : next(0), end(0) {}
+        int next;
+        int end;
+    };
+
+    // face reference of the SBVH builder, bb is clipped by the spatial splits
+    struct Reference
+    {
+        Reference() {}
+        Reference(int face, AABB bb) : face(face), bb(bb) {}
+        int  face;
+        AABB bb;
+
+        // the generic swap of math_tools.h would be ambiguous with std::swap
+        friend inline void swap(Reference &a, Reference &b) { Reference t = a; a = b; b = t; }
+    };
+
+    // SIMD_WIDTH triangles of a leaf with precomputed edges, a leaf of n faces
+    // has (n + SIMD_WIDTH - 1) / SIMD_WIDTH blocks; unused lanes have a -1
+    // face id and null edges, which the determinant test rejects
+    struct alignas(32) TriangleBlock
+    {
+        float v0[3][SIMD_WIDTH];
+        float e0[3][SIMD_WIDTH];
+        float e1[3][SIMD_WIDTH];
+        int   face_id[SIMD_WIDTH];
+    };
 
-        inline bool is_leaf(void) const { return right < 0; }
+    // ray broadcast to all the lanes of a triangle block
+    struct SimdRay
+    {
+        SimdRay(const ray &r);
+        vfloat origin[3];
+        vfloat direction[3];
     };
 
     struct face_comparator
@@ -41,32 +269,138 @@ class BVH
     };
 
 public:
-    BVH() {}
-    BVH(Mesh *mesh);
+    enum BuildMethod {SWEEP_SAH, BINNED_SAH, SBVH, LBVH, TRBVH};
+
+    // sibling pairs stay together at even indices in both orders, van Emde
+    // Boas recursively groups the top and the bottom halves of the subtrees
+    enum NodeLayout {DEPTH_FIRST, VAN_EMDE_BOAS};
+
+    BVH() : m_mesh(nullptr), m_build_method(SWEEP_SAH), m_split_budget(SBVH_SPLIT_BUDGET), m_node_layout(BVH_NODE_LAYOUT), m_build_time(0.0), m_mapped_nodes(nullptr), m_mapped_indices(nullptr),
+            m_nb_nodes(0), m_nb_indices(0), m_max_references(0), m_root_surface(0.0f) {}
+    BVH(Mesh *mesh, BuildMethod method = SWEEP_SAH, float split_budget = SBVH_SPLIT_BUDGET);
+
+    // maps the tree from cache_path if it matches the mesh, builds and saves it otherwise
+    BVH(Mesh *mesh, BuildMethod method, const std::string &cache_path, float split_budget = SBVH_SPLIT_BUDGET);
+
+    Hit  intersect(ray &r, float &t_max, TraversalStats *stats = nullptr);
+
+    // any-hit traversal for shadow rays, the face that blocks the ray goes to occluder
+    bool visibility(ray &r, float t_max, TraversalStats *stats = nullptr, Hit *occluder = nullptr);
+
+    // closest hits of the active rays of a packet, which traverse the tree
+    // together while any of them hits a node; t_max is per lane
+    void intersect_packet(const RayPacket &packet, float *t_max, Hit *hits, TraversalStats *stats = nullptr);
+
+    // traces incoherent rays together, each node is tested against all the
+    // rays that reach it 4 at a time; ids is scratch space kept by the caller.
+    // intersect_stream leaves the closest hit of each ray in its t and face_id,
+    // occluded_stream sets face_id to the occluder of the blocked rays
+    void intersect_stream(StreamRay *rays, int nb_rays, std::vector<int> &ids, TraversalStats *stats = nullptr);
+    void occluded_stream(StreamRay *rays, int nb_rays, std::vector<int> &ids, TraversalStats *stats = nullptr);
+
+    typedef std::vector<Node, aligned_allocator<Node, 64> > NodeVector;
+
+    // nodes and indices live either in m_nodes / m_indices or in the cache mapping
+    inline const Node* node_data(void)  const { return m_mapping ? m_mapped_nodes   : m_nodes.data();   }
+    inline const int*  index_data(void) const { return m_mapping ? m_mapped_indices : m_indices.data(); }
 
-    Hit  intersect(ray &r, float &t_max);
-    bool visibility(ray &r, float t_max);
+    inline const Node& node(int i)      const { return node_data()[i];  }
+    inline int         index(int i)     const { return index_data()[i]; }
+    inline int         nb_nodes(void)   const { return m_nb_nodes;      }
+    inline int         nb_indices(void) const { return m_nb_indices;    }
 
-    inline Node&              node(int i)   { return m_nodes[i]; }
-    inline std::vector<Node>& nodes(void)   { return m_nodes;    }
-    inline std::vector<int>&  indices(void) { return m_indices;  }
+    inline double build_time(void) const { return m_build_time; }
+
+    // nodes, indices and triangle blocks
+    inline size_t memory_size(void) const
+    {
+        return m_nb_nodes * sizeof(Node) + m_nb_indices * sizeof(int) + m_blocks.size() * sizeof(TriangleBlock) + m_leaf_blocks.size() * sizeof(int);
+    }
+    float tree_cost(void);
+
+    bool save(const std::string &cache_path, uint64_t mesh_hash);
+
+    // lays the nodes out again in an order that only depends on the tree, and
+    // not on the timing of the build threads; builds apply BVH_NODE_LAYOUT, and
+    // the partial rebuilds of refit keep the layout set here
+    void reorder_nodes(NodeLayout layout);
+    inline NodeLayout node_layout(void) const { return m_node_layout; }
+
+    // updates the bounds from the current mesh triangles after its vertices
+    // moved, and rebuilds the subtrees whose SAH cost grew by more than
+    // rebuild_threshold (0 only refits); returns the number of rebuilt subtrees
+    int refit(float rebuild_threshold = 0.0f, bool verbose = false);
 
 private:
     Mesh*                           m_mesh;
-    std::vector<Node>               m_nodes;
+    BuildMethod                     m_build_method;
+    float                           m_split_budget;
+    NodeLayout                      m_node_layout;
+    double                          m_build_time;
+    NodeVector                      m_nodes;
     std::vector<int>                m_indices;
-    std::vector<std::future<void> > m_futures;
 
-    int nb_nodes;
+    std::vector<NodeChunk, aligned_allocator<NodeChunk, 64> > m_chunks;
+
+    // normalized SAH cost of each subtree when it was built, loaded or
+    // rebuilt, for refit()
+    std::vector<float>              m_build_costs;
+
+    // leaf triangles in BVH order, rebuilt after each build, load or refit
+    std::vector<TriangleBlock, aligned_allocator<TriangleBlock, 64> > m_blocks;
+    std::vector<int>                m_leaf_blocks; // first block of each leaf node
+
+    std::shared_ptr<MappedFile>     m_mapping;
+    const Node*                     m_mapped_nodes;
+    const int*                      m_mapped_indices;
+
+    int m_nb_nodes;
+    int m_nb_indices;
+
+    int   m_max_references;
+    float m_root_surface;
 
-    void build_tree(int current_node, int start_index, int end_index);
+    void build(void);
+    bool load(const std::string &cache_path, uint64_t mesh_hash);
+    void build_tree(int current_node, int start_index, int end_index, int depth);
+    int  allocate_nodes(void);
+    void compact_nodes(void);
     AABB compute_face_bb(int start_index, int end_index);
     AABB compute_centroid_bb(int start_index, int end_index);
+    AABB parallel_bb(int start_index, int end_index, AABB (BVH::*compute_bb)(int, int));
     std::pair<int, int>   choose_split(int start_index, int end_index);
-    std::pair<float, int> sah_cost(int start_index, int end_index, int axis);
+    std::pair<float, int> sah_cost(int *indices, int nb_faces, int axis);
+    int  binned_split(int start_index, int end_index);
+    void bin_faces(int start_index, int end_index, const AABB &centroid_bb, const float3 &scale, SahBins &bins);
+    int  median_split(int start_index, int end_index);
+    template <typename Predicate>
+    int  partition(int start_index, int end_index, Predicate predicate);
+    float refit_node(int current_node, int depth, float *costs, bool update_bounds);
+    void  record_build_costs(void);
+    bool  subtree_range(int root, int &start_index, int &end_index);
+    void  find_degraded(int current_node, int depth, float rebuild_threshold, const float *costs, std::vector<std::pair<int, int> > &subtrees);
+    void  rebuild_subtree(int current_node, int depth);
+    void  relayout_nodes(NodeLayout layout, std::vector<int> &old_indices);
+    int   child_pairs(int pair, int *children);
+    int   pair_heights(int pair, std::vector<int> &heights);
+    void  veb_pairs(int pair, int height, const std::vector<int> &heights, std::vector<int> &order, std::vector<int> &frontier);
+    void  detach(void);
+    void  build_lbvh(void);
+    AABB  build_lbvh_node(int current_node, int start_index, int end_index, const uint64_t *codes, int depth);
+    void  optimize_treelets(int current_node, int depth, float *costs, int *heights);
+    void  restructure_treelet(int root, float *costs, int *heights);
+    void  gather_leaf_indices(void);
+    void build_sbvh(void);
+    void build_sbvh_node(int current_node, std::vector<Reference> &refs, int depth);
+    float object_split(std::vector<Reference> &refs, int &axis, float &position, AABB &left_bb, AABB &right_bb);
+    float spatial_split(std::vector<Reference> &refs, const AABB &node_bb, int &axis, float &position);
+    void  split_references(std::vector<Reference> &refs, int axis, float position, std::vector<Reference> &left, std::vector<Reference> &right);
     void sort(int start_index, int end_index, int axis);
-    Hit     intersect_faces(ray &r, float &t_max, int start_index, int end_index);
-    bool intersect_faces_ea(ray &r, float &t_max, int start_index, int end_index);
+    void build_blocks(void);
+    Hit     intersect_faces(const SimdRay &r, float &t_max, int node_index);
+    Hit     intersect_faces_ea(const SimdRay &r, float t_max, int node_index);
+    template <bool any_hit>
+    void    trace_stream(StreamRay *rays, int nb_rays, std::vector<int> &ids, TraversalStats *stats);
 };
 
 #endif // BVH_H
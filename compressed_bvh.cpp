@@ -0,0 +1,348 @@
+#include <iostream>
+#include <cmath>
+
+#include "compressed_bvh.h"
+
+#define COMPRESSED_BVH_NB_CHUNKS (COMPRESSED_BVH_WIDTH / SIMD_WIDTH)
+
+static inline float exponent_scale(int exponent)
+{
+    uint32_t bits = (uint32_t) exponent << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(float));
+    return scale;
+}
+
+// smallest biased exponent whose 255 steps from mini reach maxi
+static int choose_exponent(float mini, float maxi)
+{
+    if (!(maxi > mini))
+        return 1;
+
+    int exponent;
+    std::frexp((maxi - mini) / 255.0f, &exponent);
+    exponent += 127;
+
+    // the bound must survive the float rounding of mini + 255 * scale
+    while (exponent < 254 && mini + 255.0f * exponent_scale(exponent) < maxi)
+        ++exponent;
+
+    return std::max(1, std::min(exponent, 254));
+}
+
+CompressedBVH::SimdRay::SimdRay(const ray &r)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        origin[i] = v_set1(r.origin.data[i]);
+        inv_d[i]  = v_set1(r.inv_d.data[i]);
+    }
+}
+
+CompressedBVH::CompressedBVH(const BVH &bvh, Mesh *mesh) : m_mesh(mesh)
+{
+    m_nodes.reserve(bvh.nb_nodes() / 4 + 1);
+    m_indices.reserve(bvh.nb_indices());
+    m_nodes.resize(1);
+
+    if (bvh.node(0).is_leaf())
+    {
+        int root = 0;
+        set_children(0, bvh, bvh.node(0).aabb, &root, 1);
+    }
+    else
+    {
+        build_node(0, bvh, 0);
+    }
+
+    std::cout << "compressed BVH | " << m_nodes.size() << " nodes of width " << COMPRESSED_BVH_WIDTH << " | "
+              << memory_size() / 1048576.0 << " MB instead of " << bvh.memory_size() / 1048576.0 << " MB" << std::endl;
+}
+
+void CompressedBVH::build_node(int node_id, const BVH &bvh, int bvh_node)
+{
+    int children[COMPRESSED_BVH_WIDTH];
+    int nb_children = 0;
+
+    children[nb_children++] = bvh.node(bvh_node).offset;
+    children[nb_children++] = bvh.node(bvh_node).offset + 1;
+
+    // greedily open the inner child with the largest surface until the node is full
+    while (nb_children < COMPRESSED_BVH_WIDTH)
+    {
+        int   best_k       = -1;
+        float best_surface = -1.0f;
+        for (int k = 0; k < nb_children; ++k)
+        {
+            auto &c = bvh.node(children[k]);
+            if (!c.is_leaf() && c.aabb.surface() > best_surface)
+            {
+                best_k       = k;
+                best_surface = c.aabb.surface();
+            }
+        }
+
+        if (best_k < 0)
+            break;
+
+        int c_id = children[best_k];
+        children[best_k]        = bvh.node(c_id).offset;
+        children[nb_children++] = bvh.node(c_id).offset + 1;
+    }
+
+    set_children(node_id, bvh, bvh.node(bvh_node).aabb, children, nb_children);
+
+    int child_id = m_nodes[node_id].child_base;
+    for (int k = 0; k < nb_children; ++k)
+    {
+        if (!bvh.node(children[k]).is_leaf())
+            build_node(child_id++, bvh, children[k]);
+    }
+}
+
+// quantizes the children bounds in the frame of bb, allocates the slots of the
+// inner children and appends the faces of the leaf children
+void CompressedBVH::set_children(int node_id, const BVH &bvh, const AABB &bb, const int *children, int nb_children)
+{
+    int nb_inner = 0;
+    for (int k = 0; k < nb_children; ++k)
+        nb_inner += !bvh.node(children[k]).is_leaf();
+
+    int child_base = m_nodes.size();
+    m_nodes.resize(child_base + nb_inner);
+
+    Node &node = m_nodes[node_id];
+    node.inner_mask = 0;
+    node.child_base = child_base;
+    node.index_base = m_indices.size();
+
+    float scale[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        node.origin[a]   = bb.mini.data[a];
+        node.exponent[a] = choose_exponent(bb.mini.data[a], bb.maxi.data[a]);
+        scale[a]         = exponent_scale(node.exponent[a]);
+    }
+
+    for (int k = 0; k < COMPRESSED_BVH_WIDTH; ++k)
+    {
+        node.count[k] = 0;
+        for (int a = 0; a < 3; ++a)
+        {
+            node.q_lo[a][k] = 0;
+            node.q_hi[a][k] = 0;
+        }
+
+        if (k >= nb_children)
+            continue;
+
+        auto &c = bvh.node(children[k]);
+
+        // rounded outwards, then checked against the float decoding of the traversal
+        for (int a = 0; a < 3; ++a)
+        {
+            float o = node.origin[a];
+            float s = scale[a];
+
+            int lo = (int) std::floor((c.aabb.mini.data[a] - o) / s);
+            int hi = (int) std::ceil( (c.aabb.maxi.data[a] - o) / s);
+            lo = std::max(0, std::min(lo, 255));
+            hi = std::max(0, std::min(hi, 255));
+
+            while (lo > 0   && o + lo * s > c.aabb.mini.data[a])
+                --lo;
+            while (hi < 255 && o + hi * s < c.aabb.maxi.data[a])
+                ++hi;
+
+            node.q_lo[a][k] = lo;
+            node.q_hi[a][k] = hi;
+        }
+
+        if (c.is_leaf())
+        {
+            node.count[k] = c.count;
+            for (int ii = c.offset; ii < c.offset + c.count; ++ii)
+                m_indices.push_back(bvh.index(ii));
+        }
+        else
+        {
+            node.inner_mask |= 1 << k;
+        }
+    }
+}
+
+int CompressedBVH::intersect_children(const Node &node, const SimdRay &r, float t_max, float *t_near)
+{
+    int mask = 0;
+
+    for (int c = 0; c < COMPRESSED_BVH_NB_CHUNKS; ++c)
+    {
+        int l = c * SIMD_WIDTH;
+        vfloat t_min[3], t_far[3];
+
+        for (int a = 0; a < 3; ++a)
+        {
+            vfloat origin = v_set1(node.origin[a]);
+            vfloat scale  = v_set1(exponent_scale(node.exponent[a]));
+
+            vfloat lo = v_add(origin, v_mul(v_load_u8(node.q_lo[a] + l), scale));
+            vfloat hi = v_add(origin, v_mul(v_load_u8(node.q_hi[a] + l), scale));
+
+            vfloat t0 = v_mul(v_sub(lo, r.origin[a]), r.inv_d[a]);
+            vfloat t1 = v_mul(v_sub(hi, r.origin[a]), r.inv_d[a]);
+
+            t_min[a] = v_min(t0, t1);
+            t_far[a] = v_max(t0, t1);
+        }
+
+        // same NaN ordering as WideBVH::intersect_children
+        vfloat t_enter = v_max(v_set1(0.0f),  v_max(v_max(t_min[0], t_min[1]), t_min[2]));
+        vfloat t_exit  = v_min(v_set1(t_max), v_min(v_min(t_far[0], t_far[1]), t_far[2]));
+
+        v_store(t_near + l, t_enter);
+        mask |= v_mask(v_le(t_enter, t_exit)) << l;
+    }
+
+    // empty slots are neither inner nor leaf children
+    __m128i counts    = _mm_loadl_epi64((const __m128i*) node.count);
+    int     leaf_mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(counts, _mm_setzero_si128())) & 0xff;
+
+    return mask & (node.inner_mask | leaf_mask);
+}
+
+// pushes the hit children back to front, sorted by distance if asked
+int CompressedBVH::push_children(const Node &node, int mask, const float *t_near, StackEntry *stack, int stack_size, bool sort)
+{
+    int order[COMPRESSED_BVH_WIDTH];
+    int nb_hits = 0;
+    while (mask)
+    {
+        int k = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        int h = nb_hits++;
+        while (sort && h > 0 && t_near[order[h - 1]] > t_near[k])
+        {
+            order[h] = order[h - 1];
+            --h;
+        }
+        order[h] = k;
+    }
+
+    for (int h = nb_hits - 1; h >= 0; --h)
+    {
+        int k = order[h];
+
+        // children of each kind are stored in slot order after their base
+        int below = (1 << k) - 1;
+        if ((node.inner_mask >> k) & 1)
+        {
+            int rank = __builtin_popcount(node.inner_mask & below);
+            stack[stack_size++] = {node.child_base + rank, 0, t_near[k]};
+        }
+        else
+        {
+            int offset = node.index_base;
+            for (int j = 0; j < k; ++j)
+                offset += node.count[j];
+            stack[stack_size++] = {offset, node.count[k], t_near[k]};
+        }
+    }
+
+    return stack_size;
+}
+
+Hit CompressedBVH::intersect(ray &r, float &t_max, TraversalStats *stats)
+{
+    Hit best_hit = Hit(false, 1e32f, -1);
+
+    if (stats)
+        stats->nb_rays++;
+
+    SimdRay sr(r);
+    alignas(32) float t_near[COMPRESSED_BVH_WIDTH];
+
+    StackEntry nodes_stack[COMPRESSED_BVH_STACK_SIZE];
+    int stack_size = 0;
+    nodes_stack[stack_size++] = {0, 0, 0.0f};
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = nodes_stack[--stack_size];
+
+        if (entry.t >= t_max)
+            continue;
+
+        if (stats)
+            stats->nb_nodes++;
+
+        if (entry.count > 0)
+        {
+            if (stats)
+                stats->nb_faces += entry.count;
+
+            for (int ii = entry.child; ii < entry.child + entry.count; ++ii)
+            {
+                int i = m_indices[ii];
+                auto trit = m_mesh->triangle(i).intersect(r);
+                if (trit.first && trit.second < t_max)
+                {
+                    best_hit = Hit(true, trit.second, i);
+                    t_max    = trit.second;
+                }
+            }
+            continue;
+        }
+
+        const Node &node = m_nodes[entry.child];
+        int mask = intersect_children(node, sr, t_max, t_near);
+        stack_size = push_children(node, mask, t_near, nodes_stack, stack_size, true);
+    }
+
+    return best_hit;
+}
+
+bool CompressedBVH::visibility(ray &r, float t_max, TraversalStats *stats, Hit *occluder)
+{
+    if (stats)
+        stats->nb_rays++;
+
+    SimdRay sr(r);
+    alignas(32) float t_near[COMPRESSED_BVH_WIDTH];
+
+    StackEntry nodes_stack[COMPRESSED_BVH_STACK_SIZE];
+    int stack_size = 0;
+    nodes_stack[stack_size++] = {0, 0, 0.0f};
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = nodes_stack[--stack_size];
+
+        if (stats)
+            stats->nb_nodes++;
+
+        if (entry.count > 0)
+        {
+            if (stats)
+                stats->nb_faces += entry.count;
+
+            for (int ii = entry.child; ii < entry.child + entry.count; ++ii)
+            {
+                auto trit = m_mesh->triangle(m_indices[ii]).intersect(r);
+                if (trit.first && trit.second <= t_max)
+                {
+                    if (occluder)
+                        *occluder = Hit(true, trit.second, m_indices[ii]);
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        const Node &node = m_nodes[entry.child];
+        int mask = intersect_children(node, sr, t_max, t_near);
+        stack_size = push_children(node, mask, t_near, nodes_stack, stack_size, false);
+    }
+
+    return false;
+}
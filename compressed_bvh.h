@@ -0,0 +1,71 @@
+#ifndef COMPRESSED_BVH_H
+#define COMPRESSED_BVH_H
+
+#include "simd_tools.h"
+
+#define COMPRESSED_BVH_WIDTH      8
+#define COMPRESSED_BVH_STACK_SIZE (64 * COMPRESSED_BVH_WIDTH)
+
+#include <vector>
+#include <cstdint>
+
+#include "math_tools.h"
+#include "memory_tools.h"
+#include "geometry.h"
+#include "mesh.h"
+#include "bvh.h"
+
+// BVH8 collapsed from a binary BVH with 80 byte nodes, after Ylitie et al. 2017
+// "Efficient Incoherent Ray Traversal on GPUs Through Compressed Wide BVHs":
+// child bounds are 8-bit offsets from the node origin in units of a per-axis
+// power of two, rounded outwards, and decoded on the fly by the traversal.
+class CompressedBVH
+{
+    struct alignas(16) Node
+    {
+        float   origin[3];
+        uint8_t exponent[3];  // biased like a float exponent, the scale is 2^(exponent - 127)
+        uint8_t inner_mask;   // children that are nodes
+        int32_t child_base;   // index of the first inner child, the others follow in slot order
+        int32_t index_base;   // first index of the first leaf child, the others follow in slot order
+        uint8_t count[COMPRESSED_BVH_WIDTH]; // faces of a leaf child, 0 for a node or an empty slot
+        uint8_t q_lo[3][COMPRESSED_BVH_WIDTH];
+        uint8_t q_hi[3][COMPRESSED_BVH_WIDTH];
+    };
+
+    struct SimdRay
+    {
+        SimdRay(const ray &r);
+        vfloat origin[3];
+        vfloat inv_d[3];
+    };
+
+    struct StackEntry
+    {
+        int   child;
+        int   count;
+        float t;
+    };
+
+public:
+    CompressedBVH() {}
+    CompressedBVH(const BVH &bvh, Mesh *mesh);
+
+    Hit  intersect(ray &r, float &t_max, TraversalStats *stats = nullptr);
+    bool visibility(ray &r, float t_max, TraversalStats *stats = nullptr, Hit *occluder = nullptr);
+
+    inline int    nb_nodes(void)    const { return m_nodes.size(); }
+    inline size_t memory_size(void) const { return m_nodes.size() * sizeof(Node) + m_indices.size() * sizeof(int); }
+
+private:
+    Mesh*                                           m_mesh;
+    std::vector<Node, aligned_allocator<Node, 64> > m_nodes;
+    std::vector<int>                                m_indices;
+
+    void build_node(int node_id, const BVH &bvh, int bvh_node);
+    void set_children(int node_id, const BVH &bvh, const AABB &bb, const int *children, int nb_children);
+    int  intersect_children(const Node &node, const SimdRay &r, float t_max, float *t_near);
+    int  push_children(const Node &node, int mask, const float *t_near, StackEntry *stack, int stack_size, bool sort);
+};
+
+#endif // COMPRESSED_BVH_H
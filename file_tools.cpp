@@ -1,3 +1,8 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "file_tools.h"
 
 void write_ppm(std::vector<float3> &image, int height, int width, std::string &file_path)
@@ -25,3 +30,30 @@ void write_ppm(std::vector<float3> &image, int height, int width, std::string &f
 
     std::cout << "Wrote a " << width << " by " << height << " image." << std::endl;
 }
+
+MappedFile::MappedFile(const char *file_path) : m_data(nullptr), m_size(0)
+{
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+    {
+        void *data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            m_data = (const char*) data;
+            m_size = file_stat.st_size;
+        }
+    }
+
+    // the mapping stays valid once the descriptor is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data)
+        munmap((void*) m_data, m_size);
+}
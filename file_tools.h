@@ -18,4 +18,23 @@ struct color {uchar r; uchar g; uchar b;};
 
 void write_ppm(std::vector<float3> &image, int height, int width, std::string &file_path);
 
+// read-only, zero-copy mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile(const char *file_path);
+    ~MappedFile();
+
+    inline bool        is_open(void) const { return m_data != nullptr; }
+    inline const char* data(void)    const { return m_data; }
+    inline size_t      size(void)    const { return m_size; }
+
+private:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char *m_data;
+    size_t      m_size;
+};
+
 #endif // FILE_TOOLS_H
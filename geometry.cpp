@@ -58,7 +58,7 @@ float3 Triangle::barycentric_coords(float3 &p) const
     return float3(1.0f - beta - gamma, beta, gamma);
 }
 
-std::pair <bool, float> AABB::intersect(const ray &r, float t_min)
+std::pair <bool, float> AABB::intersect(const ray &r, float t_min) const
 {
     for (int i = 0; i < 3; ++i)
     {
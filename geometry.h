@@ -12,6 +12,7 @@ struct ray
     float3 direction;
     float3 inv_d;
 
+    ray() {}
     ray(float3 origin, float3 direction) : origin(origin), direction(direction) {
         inv_d = float3(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
     }
@@ -23,9 +24,9 @@ public:
     AABB() {}
     AABB(float3 min, float3 max) : mini(min), maxi(max) {}
 
-    std::pair<bool, float> intersect(const ray &r, float t_min = 0.0f);
+    std::pair<bool, float> intersect(const ray &r, float t_min = 0.0f) const;
 
-    inline float surface()
+    inline float surface() const
     {
         float3 diff = maxi - mini;
         return 2.0f * (diff.x * diff.y +  diff.x * diff.z + diff.z * diff.y);
@@ -109,9 +110,10 @@ struct Hit
     bool  did_hit;
     float t;
     int   face_id;
+    int   instance_id; // -1 outside of a Scene
 
     Hit() {}
-    Hit(bool did_hit, float t, int face_id) : did_hit(did_hit), t(t), face_id(face_id) {}
+    Hit(bool did_hit, float t, int face_id, int instance_id = -1) : did_hit(did_hit), t(t), face_id(face_id), instance_id(instance_id) {}
 
     inline operator bool() const { return did_hit; }
 };
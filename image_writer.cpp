@@ -0,0 +1,53 @@
+#include "image_writer.h"
+#include "file_tools.h"
+
+ImageWriter::ImageWriter(const std::string &file_path)
+    : m_file_path(file_path), m_height(0), m_width(0), m_has_pending(false), m_stop(false)
+{
+    m_thread = std::thread(&ImageWriter::run, this);
+}
+
+ImageWriter::~ImageWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+}
+
+void ImageWriter::submit(const std::vector<float3> &image, int height, int width)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending     = image;
+        m_height      = height;
+        m_width       = width;
+        m_has_pending = true;
+    }
+    m_wake.notify_one();
+}
+
+void ImageWriter::run(void)
+{
+    std::vector<float3> image;
+
+    while (true)
+    {
+        int height, width;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this]() { return m_stop || m_has_pending; });
+            if (!m_has_pending)
+                return;
+
+            image.swap(m_pending);
+            height        = m_height;
+            width         = m_width;
+            m_has_pending = false;
+        }
+
+        write_ppm(image, height, width, m_file_path);
+    }
+}
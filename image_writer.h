@@ -0,0 +1,40 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "math_tools.h"
+
+// Writes the images handed to it as ppm files on its own thread, so that the
+// render never waits on the disk. An image submitted while the previous one
+// is still pending replaces it, only the latest one matters.
+class ImageWriter
+{
+public:
+    ImageWriter(const std::string &file_path);
+    ~ImageWriter(); // writes the pending image before returning
+
+    ImageWriter(const ImageWriter&) = delete;
+    ImageWriter& operator=(const ImageWriter&) = delete;
+
+    void submit(const std::vector<float3> &image, int height, int width);
+
+private:
+    std::string         m_file_path;
+    std::vector<float3> m_pending;
+    int                 m_height, m_width;
+    bool                m_has_pending;
+    bool                m_stop;
+
+    std::mutex              m_mutex;
+    std::condition_variable m_wake;
+    std::thread             m_thread;
+
+    void run(void);
+};
+
+#endif // IMAGE_WRITER_H
@@ -0,0 +1,124 @@
+#include "bvh.h"
+
+void BVH::reorder_nodes(NodeLayout layout)
+{
+    if (layout == m_node_layout)
+        return;
+
+    detach();
+    m_node_layout = layout;
+
+    std::vector<int> old_indices;
+    relayout_nodes(layout, old_indices);
+    build_blocks();
+
+    std::vector<float> build_costs(m_nb_nodes);
+    for (int i = 0; i < m_nb_nodes; ++i)
+        build_costs[i] = m_build_costs[old_indices[i]];
+    m_build_costs.swap(build_costs);
+}
+
+// copies the sibling pairs reachable from the root in the given order and
+// remaps the children, old_indices gives the previous slot of each node
+void BVH::relayout_nodes(NodeLayout layout, std::vector<int> &old_indices)
+{
+    // previous first slot of each pair, in the new order; the root pair holds
+    // the root and the padding slot
+    std::vector<int> order;
+    order.reserve(m_nb_nodes / 2);
+
+    if (layout == VAN_EMDE_BOAS)
+    {
+        std::vector<int> heights(m_nb_nodes / 2);
+        std::vector<int> frontier;
+        veb_pairs(0, pair_heights(0, heights), heights, order, frontier);
+    }
+    else
+    {
+        std::vector<int> stack(1, 0);
+        while (!stack.empty())
+        {
+            int pair = stack.back();
+            stack.pop_back();
+            order.push_back(pair);
+
+            int children[2];
+            int nb_children = child_pairs(pair, children);
+            for (int k = nb_children - 1; k >= 0; --k)
+                stack.push_back(children[k]);
+        }
+    }
+
+    std::vector<int> new_pairs(m_nb_nodes / 2, -1);
+    NodeVector nodes(2 * order.size());
+    old_indices.resize(2 * order.size());
+
+    for (size_t k = 0; k < order.size(); ++k)
+    {
+        new_pairs[order[k] / 2] = 2 * k;
+        nodes[2 * k    ]        = m_nodes[order[k]    ];
+        nodes[2 * k + 1]        = m_nodes[order[k] + 1];
+        old_indices[2 * k    ]  = order[k];
+        old_indices[2 * k + 1]  = order[k] + 1;
+    }
+
+    for (size_t i = 2; i < nodes.size(); ++i)
+    {
+        if (!nodes[i].is_leaf())
+            nodes[i].offset = new_pairs[nodes[i].offset / 2];
+    }
+    if (!nodes[0].is_leaf())
+        nodes[0].offset = new_pairs[nodes[0].offset / 2];
+
+    m_nb_nodes = nodes.size();
+    m_nodes.swap(nodes);
+}
+
+// pairs holding the children of the inner nodes of a pair, the padding slot 1 has none
+int BVH::child_pairs(int pair, int *children)
+{
+    int nb_children = 0;
+    for (int i = pair; i < pair + 2; ++i)
+    {
+        if (i != 1 && !m_nodes[i].is_leaf())
+            children[nb_children++] = m_nodes[i].offset;
+    }
+    return nb_children;
+}
+
+// number of pair levels below and including each pair, indexed by pair / 2
+int BVH::pair_heights(int pair, std::vector<int> &heights)
+{
+    int children[2];
+    int nb_children = child_pairs(pair, children);
+
+    int height = 0;
+    for (int k = 0; k < nb_children; ++k)
+        height = std::max(height, pair_heights(children[k], heights));
+
+    heights[pair / 2] = height + 1;
+    return height + 1;
+}
+
+// lays out the first height levels below pair: the top half of the levels,
+// then each subtree below it; the pairs right below the levels go to frontier
+void BVH::veb_pairs(int pair, int height, const std::vector<int> &heights, std::vector<int> &order, std::vector<int> &frontier)
+{
+    if (height == 1)
+    {
+        order.push_back(pair);
+
+        int children[2];
+        int nb_children = child_pairs(pair, children);
+        frontier.insert(frontier.end(), children, children + nb_children);
+        return;
+    }
+
+    int top_height = height / 2;
+
+    std::vector<int> top_frontier;
+    veb_pairs(pair, top_height, heights, order, top_frontier);
+
+    for (int child : top_frontier)
+        veb_pairs(child, std::min(height - top_height, heights[child / 2]), heights, order, frontier);
+}
@@ -0,0 +1,365 @@
+#include <algorithm>
+#include <numeric>
+
+#include "bvh.h"
+
+// linear BVH, Lauterbach et al. 2009 "Fast BVH Construction on GPUs", and its
+// treelet restructuring, Karras and Aila 2013 "Fast Parallel Construction of
+// High-Quality Bounding Volume Hierarchies"
+
+#define LBVH_RADIX_SIZE (1 << LBVH_RADIX_BITS)
+
+// spreads the LBVH_MORTON_BITS low bits of x two bits apart
+static inline uint64_t expand_bits(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x <<  8) & 0x100f00f00f00f00full;
+    x = (x | x <<  4) & 0x10c30c30c30c30c3ull;
+    x = (x | x <<  2) & 0x1249249249249249ull;
+    return x;
+}
+
+// LSD radix sort of the (key, value) pairs; each pass counts the digits of
+// blocks of BVH_PARALLEL_GRAIN keys in parallel, and every block then scatters
+// its keys from its own offset within each digit, which keeps the sort stable
+static void radix_sort(std::vector<uint64_t> &keys, std::vector<int> &values)
+{
+    int n         = keys.size();
+    int nb_blocks = (n + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+
+    std::vector<uint64_t> tmp_keys(n);
+    std::vector<int>      tmp_values(n);
+    std::vector<int>      offsets(nb_blocks * LBVH_RADIX_SIZE);
+
+    for (int shift = 0; shift < 3 * LBVH_MORTON_BITS; shift += LBVH_RADIX_BITS)
+    {
+        TaskPool::global().parallel_for(0, n, BVH_PARALLEL_GRAIN, [&](int begin, int end) {
+            int *count = &offsets[begin / BVH_PARALLEL_GRAIN * LBVH_RADIX_SIZE];
+            std::fill(count, count + LBVH_RADIX_SIZE, 0);
+            for (int i = begin; i < end; ++i)
+                count[(keys[i] >> shift) & (LBVH_RADIX_SIZE - 1)]++;
+        });
+
+        // a pass where all the keys share the same digit leaves them in place
+        bool is_sorted = false;
+        int  offset    = 0;
+        for (int d = 0; d < LBVH_RADIX_SIZE; ++d)
+        {
+            int digit_start = offset;
+            for (int b = 0; b < nb_blocks; ++b)
+            {
+                int count = offsets[b * LBVH_RADIX_SIZE + d];
+                offsets[b * LBVH_RADIX_SIZE + d] = offset;
+                offset += count;
+            }
+            is_sorted |= offset - digit_start == n;
+        }
+
+        if (is_sorted)
+            continue;
+
+        TaskPool::global().parallel_for(0, n, BVH_PARALLEL_GRAIN, [&](int begin, int end) {
+            int *offset = &offsets[begin / BVH_PARALLEL_GRAIN * LBVH_RADIX_SIZE];
+            for (int i = begin; i < end; ++i)
+            {
+                int position = offset[(keys[i] >> shift) & (LBVH_RADIX_SIZE - 1)]++;
+                tmp_keys[position]   = keys[i];
+                tmp_values[position] = values[i];
+            }
+        });
+
+        keys.swap(tmp_keys);
+        values.swap(tmp_values);
+    }
+}
+
+void BVH::build_lbvh(void)
+{
+    int nb_faces = m_mesh->nb_faces();
+
+    m_indices.resize(nb_faces);
+    std::iota(m_indices.begin(), m_indices.end(), 0);
+
+    // centroids are quantized on a grid of 2^LBVH_MORTON_BITS cells per axis
+    AABB   centroid_bb = compute_centroid_bb(0, nb_faces);
+    float3 extent      = centroid_bb.maxi - centroid_bb.mini;
+    float  grid_size   = (float) ((1 << LBVH_MORTON_BITS) - 1);
+    float3 scale;
+    for (int a = 0; a < 3; ++a)
+        scale.data[a] = extent.data[a] > 0.0f ? grid_size / extent.data[a] : 0.0f;
+
+    std::vector<uint64_t> codes(nb_faces);
+    TaskPool::global().parallel_for(0, nb_faces, BVH_PARALLEL_GRAIN, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            float3 c = (m_mesh->centroid(i) - centroid_bb.mini) * scale;
+            uint64_t x = (uint64_t) std::min(std::max(c.x, 0.0f), grid_size);
+            uint64_t y = (uint64_t) std::min(std::max(c.y, 0.0f), grid_size);
+            uint64_t z = (uint64_t) std::min(std::max(c.z, 0.0f), grid_size);
+            codes[i] = expand_bits(x) << 2 | expand_bits(y) << 1 | expand_bits(z);
+        }
+    });
+
+    radix_sort(codes, m_indices);
+
+    m_chunks.assign(TaskPool::global().nb_threads() + 1, NodeChunk());
+    m_nodes.resize(2 * nb_faces + m_chunks.size() * BVH_NODE_CHUNK_SIZE);
+
+    // slot 1 is left empty so that every sibling pair starts at an even index
+    m_nodes[1] = Node(AABB(float3(0.0f), float3(0.0f)), 0, 0);
+    m_nb_nodes = 2;
+    build_lbvh_node(0, 0, nb_faces, codes.data(), 0);
+    compact_nodes();
+
+    m_nb_indices = nb_faces;
+
+    if (m_build_method == TRBVH)
+    {
+        std::vector<float> costs(m_nb_nodes);
+        std::vector<int>   heights(m_nb_nodes);
+        optimize_treelets(0, 0, costs.data(), heights.data());
+        gather_leaf_indices();
+    }
+}
+
+// the treelets are rewritten over the index ranges their leaves already had,
+// so the faces of a subtree may be spread out; the indices are laid out again
+// in depth-first leaf order, which gives every subtree one range for refit
+void BVH::gather_leaf_indices(void)
+{
+    std::vector<int> indices;
+    indices.reserve(m_nb_indices);
+
+    std::vector<int> stack(1, 0);
+    while (!stack.empty())
+    {
+        Node &node = m_nodes[stack.back()];
+        stack.pop_back();
+
+        if (node.is_leaf())
+        {
+            int offset = indices.size();
+            indices.insert(indices.end(), m_indices.begin() + node.offset, m_indices.begin() + node.offset + node.count);
+            node.offset = offset;
+            continue;
+        }
+
+        stack.push_back(node.offset + 1);
+        stack.push_back(node.offset);
+    }
+
+    m_indices.swap(indices);
+}
+
+// splits the sorted range where the highest differing bit of its codes
+// changes, and returns the bounds of the node computed bottom-up
+AABB BVH::build_lbvh_node(int current_node, int start_index, int end_index, const uint64_t *codes, int depth)
+{
+    Node &node = m_nodes[current_node];
+
+    if (end_index - start_index <= LBVH_MAX_FACES_PER_LEAF)
+    {
+        node = Node(compute_face_bb(start_index, end_index), start_index, end_index - start_index);
+        return node.aabb;
+    }
+
+    // identical codes, or past MAX_SAH_DEPTH to bound the traversal stack, split at the median
+    int split_index = (start_index + end_index) / 2;
+
+    uint64_t diff = codes[start_index] ^ codes[end_index - 1];
+    if (diff != 0 && depth < MAX_SAH_DEPTH)
+    {
+        int bit = 63 - __builtin_clzll(diff);
+        split_index = std::partition_point(codes + start_index, codes + end_index, [bit](uint64_t code) {
+            return !((code >> bit) & 1);
+        }) - codes;
+    }
+
+    int left_index = allocate_nodes();
+
+    AABB left_aabb, right_aabb;
+    if (end_index - start_index > BVH_TASK_THRESHOLD)
+    {
+        TaskGroup group;
+        group.run([&]() {
+            left_aabb = build_lbvh_node(left_index, start_index, split_index, codes, depth + 1);
+        });
+        right_aabb = build_lbvh_node(left_index + 1, split_index, end_index, codes, depth + 1);
+        group.wait();
+    }
+    else
+    {
+        left_aabb  = build_lbvh_node(left_index,     start_index, split_index, codes, depth + 1);
+        right_aabb = build_lbvh_node(left_index + 1, split_index,   end_index, codes, depth + 1);
+    }
+
+    node.aabb = left_aabb;
+    node.aabb.extend(right_aabb);
+    node.offset = left_index;
+    node.count  = 0;
+    return node.aabb;
+}
+
+// restructures the treelets bottom-up, children before their parent; costs and
+// heights receive the SAH cost and the height of every subtree
+void BVH::optimize_treelets(int current_node, int depth, float *costs, int *heights)
+{
+    const Node &node = m_nodes[current_node];
+
+    if (node.is_leaf())
+    {
+        costs[current_node]   = SAH_INTERSECTION_COST * node.aabb.surface() * node.count;
+        heights[current_node] = 0;
+        return;
+    }
+
+    int left_index = node.offset;
+    if (depth < BVH_REFIT_TASK_DEPTH)
+    {
+        TaskGroup group;
+        group.run([=]() {
+            optimize_treelets(left_index, depth + 1, costs, heights);
+        });
+        optimize_treelets(left_index + 1, depth + 1, costs, heights);
+        group.wait();
+    }
+    else
+    {
+        optimize_treelets(left_index,     depth + 1, costs, heights);
+        optimize_treelets(left_index + 1, depth + 1, costs, heights);
+    }
+
+    costs[current_node]   = SAH_TRAVERSAL_COST * node.aabb.surface() + costs[left_index] + costs[left_index + 1];
+    heights[current_node] = 1 + std::max(heights[left_index], heights[left_index + 1]);
+
+    restructure_treelet(current_node, costs, heights);
+}
+
+// grows a treelet from root by opening its largest leaf until it has
+// LBVH_TREELET_SIZE leaves, finds the topology of lowest SAH cost over these
+// leaves by dynamic programming on their subsets, and rewrites the treelet in
+// its own slots if that topology is cheaper and no higher
+void BVH::restructure_treelet(int root, float *costs, int *heights)
+{
+    int leaves[LBVH_TREELET_SIZE];
+    int pairs[LBVH_TREELET_SIZE - 1]; // children of the inner nodes of the treelet
+    int nb_leaves = 2;
+    int nb_pairs  = 1;
+
+    leaves[0] = m_nodes[root].offset;
+    leaves[1] = m_nodes[root].offset + 1;
+    pairs[0]  = m_nodes[root].offset;
+
+    while (nb_leaves < LBVH_TREELET_SIZE)
+    {
+        int   best_k       = -1;
+        float best_surface = -1.0f;
+        for (int k = 0; k < nb_leaves; ++k)
+        {
+            const Node &leaf = m_nodes[leaves[k]];
+            if (!leaf.is_leaf() && leaf.aabb.surface() > best_surface)
+            {
+                best_k       = k;
+                best_surface = leaf.aabb.surface();
+            }
+        }
+
+        if (best_k < 0)
+            break;
+
+        int offset = m_nodes[leaves[best_k]].offset;
+        pairs[nb_pairs++]   = offset;
+        leaves[best_k]      = offset;
+        leaves[nb_leaves++] = offset + 1;
+    }
+
+    if (nb_leaves < 3)
+        return;
+
+    const int nb_subsets = 1 << LBVH_TREELET_SIZE;
+    AABB  bbs[nb_subsets];
+    float subset_costs[nb_subsets];
+    int   heights_of[nb_subsets];
+    int   partitions[nb_subsets];
+
+    int full = (1 << nb_leaves) - 1;
+    for (int s = 1; s <= full; ++s)
+    {
+        int low = s & -s;
+        int k   = __builtin_ctz(s);
+
+        if (s == low)
+        {
+            bbs[s]          = m_nodes[leaves[k]].aabb;
+            subset_costs[s] = costs[leaves[k]];
+            heights_of[s]   = heights[leaves[k]];
+            continue;
+        }
+
+        bbs[s] = bbs[s ^ low];
+        bbs[s].extend(bbs[low]);
+
+        // each partition is visited once, with the lowest leaf on the first side
+        float best_cost = 1e32f;
+        for (int p = (s - 1) & s; p; p = (p - 1) & s)
+        {
+            if (!(p & low))
+                continue;
+
+            float cost = subset_costs[p] + subset_costs[s ^ p];
+            if (cost < best_cost)
+            {
+                best_cost     = cost;
+                partitions[s] = p;
+            }
+        }
+
+        subset_costs[s] = SAH_TRAVERSAL_COST * bbs[s].surface() + best_cost;
+        heights_of[s]   = 1 + std::max(heights_of[partitions[s]], heights_of[s ^ partitions[s]]);
+    }
+
+    if (subset_costs[full] >= costs[root] || heights_of[full] > heights[root])
+        return;
+
+    Node  leaf_nodes[LBVH_TREELET_SIZE];
+    float leaf_costs[LBVH_TREELET_SIZE];
+    int   leaf_heights[LBVH_TREELET_SIZE];
+    for (int k = 0; k < nb_leaves; ++k)
+    {
+        leaf_nodes[k]   = m_nodes[leaves[k]];
+        leaf_costs[k]   = costs[leaves[k]];
+        leaf_heights[k] = heights[leaves[k]];
+    }
+
+    // the root keeps its slot and its pair, the other pairs are handed out in order
+    std::pair<int, int> stack[2 * LBVH_TREELET_SIZE];
+    int stack_size = 0;
+    int next_pair  = 0;
+    stack[stack_size++] = std::make_pair(root, full);
+
+    while (stack_size > 0)
+    {
+        int slot = stack[stack_size - 1].first;
+        int s    = stack[stack_size - 1].second;
+        --stack_size;
+
+        if ((s & (s - 1)) == 0)
+        {
+            int k = __builtin_ctz(s);
+            m_nodes[slot] = leaf_nodes[k];
+            costs[slot]   = leaf_costs[k];
+            heights[slot] = leaf_heights[k];
+            continue;
+        }
+
+        int pair = pairs[next_pair++];
+        m_nodes[slot] = Node(bbs[s], pair, 0);
+        costs[slot]   = subset_costs[s];
+        heights[slot] = heights_of[s];
+
+        stack[stack_size++] = std::make_pair(pair,     partitions[s]);
+        stack[stack_size++] = std::make_pair(pair + 1, s ^ partitions[s]);
+    }
+}
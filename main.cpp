@@ -15,26 +15,268 @@
 #include "camera.h"
 #include "time_tools.h"
 #include "bvh.h"
+#include "wide_bvh.h"
 #include "sampler.h"
 #include "renderer.h"
+#include "scene.h"
 #include "file_tools.h"
 
 int main(int argc, char** argv)
 {
-    if (argc != 4)
+    if (argc < 4)
     {
-      std::cerr << "Usage: " << argv[0] << " [filename] [image width] [spp]"<< std::endl;
+      std::cerr << "Usage: " << argv[0] << " [filename] [image width] [spp] [options]"<< std::endl;
+      std::cerr << "Options:" << std::endl;
+      std::cerr << "  --bvh [sweep|binned|sbvh|lbvh|trbvh] BVH build method (default sweep)" << std::endl;
+      std::cerr << "  --sbvh-budget [f]     extra face references allowed by spatial splits (default " << SBVH_SPLIT_BUDGET << ")" << std::endl;
+      std::cerr << "  --bvh-cache [file]    map the BVH from file, (re)build and save it if stale" << std::endl;
+      std::cerr << "  --bvh-layout [depth|veb] order of the BVH nodes in memory, depth-first or van Emde Boas (default depth)" << std::endl;
+      std::cerr << "  --wide-bvh            traverse a " << WIDE_BVH_WIDTH << "-wide SIMD BVH" << std::endl;
+      std::cerr << "  --compressed-bvh      traverse an 8-wide BVH with quantized bounds" << std::endl;
+      std::cerr << "  --no-packets          trace primary rays one by one" << std::endl;
+      std::cerr << "  --batch-shadows       trace the shadow rays of each tile together" << std::endl;
+      std::cerr << "  --wavefront           trace the paths of each tile in stages over ray streams" << std::endl;
+      std::cerr << "  --instances [n]       render an n x n grid of instances of the mesh" << std::endl;
+      std::cerr << "  --refit [n]           ripple the mesh over n frames, refitting the BVH each frame, then render the last one" << std::endl;
+      std::cerr << "  --tile-size [n]       pixels on a side of the tiles shared by the threads (default " << TILE_SIZE << ")" << std::endl;
+      std::cerr << "  --tile-order [scanline|morton|hilbert] order the threads take the tiles in (default hilbert)" << std::endl;
+      std::cerr << "  --tile-stats [file]   write the render time of each tile as csv" << std::endl;
+      std::cerr << "  --max-depth [n]       bounces of a path at most (default 5, up to " << MAX_PATH_DEPTH << ")" << std::endl;
+      std::cerr << "  --rr-depth [n]        bounces before russian roulette may end a path (default " << RR_MIN_DEPTH << ")" << std::endl;
+      std::cerr << "  --progressive         render in passes and write out.ppm as it converges, spp 0 for no bound" << std::endl;
+      std::cerr << "  --time-budget [s]     stop a progressive render after about s seconds" << std::endl;
+      std::cerr << "  --pass-spp [n]        samples per pixel of each pass (default " << PROGRESSIVE_PASS_SPP << ")" << std::endl;
+      std::cerr << "  --write-interval [s]  seconds between the images written during the render (default 5)" << std::endl;
+      std::cerr << "  --adaptive [e]        stop sampling the pixels with a relative error below e (default " << ADAPTIVE_THRESHOLD << ")" << std::endl;
+      std::cerr << "  --adaptive-base [n]   samples of every pixel before adaptive sampling starts (default " << ADAPTIVE_BASE_SPP << ")" << std::endl;
+      std::cerr << "  --heatmap [file]      write the samples per pixel as a ppm image" << std::endl;
+      std::cerr << "  --sampler [random|sobol|owen|zsobol] sample tables with per-pixel offsets, scrambled Sobol computed per pixel (default owen)," << std::endl;
+      std::cerr << "                        or Sobol shared by the pixels in Z-order for blue-noise error at low spp" << std::endl;
       return 1;
     }
 
+    bool use_wide_bvh = false;
+    bool use_packets  = true;
+    bool batch_shadows = false;
+    bool use_wavefront = false;
+    bool use_compressed_bvh = false;
+    BVH::BuildMethod bvh_method = BVH::SWEEP_SAH;
+    BVH::NodeLayout  bvh_layout = BVH_NODE_LAYOUT;
+    std::string bvh_cache;
+    float split_budget = SBVH_SPLIT_BUDGET;
+    int nb_instances = 1;
+    int refit_frames = 0;
+    int path_depth = 5;
+    int rr_depth   = RR_MIN_DEPTH;
+    int tile_size  = TILE_SIZE;
+    TileScheduler::Order tile_order = TileScheduler::HILBERT;
+    std::string tile_stats;
+    bool   progressive    = false;
+    double time_budget    = 0.0;
+    int    pass_spp       = PROGRESSIVE_PASS_SPP;
+    double write_interval = 5.0;
+    float  adaptive_threshold = 0.0f;
+    int    adaptive_base_spp  = ADAPTIVE_BASE_SPP;
+    std::string heatmap_file;
+    Sampler::Method sampler_method = Sampler::OWEN_SOBOL;
+    for (int a = 4; a < argc; ++a)
+    {
+        std::string arg(argv[a]);
+        if (arg == "--wide-bvh")
+        {
+            use_wide_bvh = true;
+        }
+        else if (arg == "--compressed-bvh")
+        {
+            use_compressed_bvh = true;
+        }
+        else if (arg == "--no-packets")
+        {
+            use_packets = false;
+        }
+        else if (arg == "--batch-shadows")
+        {
+            batch_shadows = true;
+        }
+        else if (arg == "--wavefront")
+        {
+            use_wavefront = true;
+        }
+        else if (arg == "--bvh-cache" && a + 1 < argc)
+        {
+            bvh_cache = argv[++a];
+        }
+        else if (arg == "--bvh-layout" && a + 1 < argc)
+        {
+            std::string layout(argv[++a]);
+            if (layout == "depth")
+            {
+                bvh_layout = BVH::DEPTH_FIRST;
+            }
+            else if (layout == "veb")
+            {
+                bvh_layout = BVH::VAN_EMDE_BOAS;
+            }
+            else
+            {
+                std::cerr << "Unknown BVH layout: " << layout << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--instances" && a + 1 < argc)
+        {
+            nb_instances = std::max(1, std::atoi(argv[++a]));
+        }
+        else if (arg == "--refit" && a + 1 < argc)
+        {
+            refit_frames = std::max(0, std::atoi(argv[++a]));
+        }
+        else if (arg == "--tile-size" && a + 1 < argc)
+        {
+            tile_size = std::atoi(argv[++a]);
+        }
+        else if (arg == "--tile-stats" && a + 1 < argc)
+        {
+            tile_stats = argv[++a];
+        }
+        else if (arg == "--tile-order" && a + 1 < argc)
+        {
+            std::string order(argv[++a]);
+            if (order == "scanline")
+            {
+                tile_order = TileScheduler::SCANLINE;
+            }
+            else if (order == "morton")
+            {
+                tile_order = TileScheduler::MORTON;
+            }
+            else if (order == "hilbert")
+            {
+                tile_order = TileScheduler::HILBERT;
+            }
+            else
+            {
+                std::cerr << "Unknown tile order: " << order << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--max-depth" && a + 1 < argc)
+        {
+            path_depth = std::min(std::max(1, std::atoi(argv[++a])), MAX_PATH_DEPTH);
+        }
+        else if (arg == "--rr-depth" && a + 1 < argc)
+        {
+            rr_depth = std::max(1, std::atoi(argv[++a]));
+        }
+        else if (arg == "--progressive")
+        {
+            progressive = true;
+        }
+        else if (arg == "--time-budget" && a + 1 < argc)
+        {
+            time_budget = std::atof(argv[++a]);
+            progressive = true;
+        }
+        else if (arg == "--pass-spp" && a + 1 < argc)
+        {
+            pass_spp = std::max(1, std::atoi(argv[++a]));
+        }
+        else if (arg == "--write-interval" && a + 1 < argc)
+        {
+            write_interval = std::atof(argv[++a]);
+        }
+        else if (arg == "--adaptive")
+        {
+            adaptive_threshold = ADAPTIVE_THRESHOLD;
+            if (a + 1 < argc && argv[a + 1][0] != '-')
+                adaptive_threshold = std::atof(argv[++a]);
+        }
+        else if (arg == "--adaptive-base" && a + 1 < argc)
+        {
+            adaptive_base_spp = std::atoi(argv[++a]);
+        }
+        else if (arg == "--heatmap" && a + 1 < argc)
+        {
+            heatmap_file = argv[++a];
+        }
+        else if (arg == "--sampler" && a + 1 < argc)
+        {
+            std::string method(argv[++a]);
+            if (method == "random")
+            {
+                sampler_method = Sampler::RANDOM;
+            }
+            else if (method == "sobol")
+            {
+                sampler_method = Sampler::SOBOL;
+            }
+            else if (method == "owen")
+            {
+                sampler_method = Sampler::OWEN_SOBOL;
+            }
+            else if (method == "zsobol")
+            {
+                sampler_method = Sampler::Z_SOBOL;
+            }
+            else
+            {
+                std::cerr << "Unknown sampler: " << method << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--sbvh-budget" && a + 1 < argc)
+        {
+            split_budget = std::atof(argv[++a]);
+        }
+        else if (arg == "--bvh" && a + 1 < argc)
+        {
+            std::string method(argv[++a]);
+            if (method == "sweep")
+            {
+                bvh_method = BVH::SWEEP_SAH;
+            }
+            else if (method == "binned")
+            {
+                bvh_method = BVH::BINNED_SAH;
+            }
+            else if (method == "sbvh")
+            {
+                bvh_method = BVH::SBVH;
+            }
+            else if (method == "lbvh")
+            {
+                bvh_method = BVH::LBVH;
+            }
+            else if (method == "trbvh")
+            {
+                bvh_method = BVH::TRBVH;
+            }
+            else
+            {
+                std::cerr << "Unknown BVH build method: " << method << std::endl;
+                return 1;
+            }
+        }
+        else
+        {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if (refit_frames > 0 && nb_instances > 1)
+    {
+        std::cerr << "--refit only animates a single mesh, not --instances" << std::endl;
+        return 1;
+    }
+
     std::string filename = std::string(argv[1]);
-    Mesh mesh = read_obj(filename.c_str());
+    Mesh mesh = read_obj_parallel(filename.c_str());
 
     int width  = std::atoi(argv[2]);
     int height = width;
     int spp = std::atoi(argv[3]);
     //spp *= spp;
-    int path_depth = 5;
 
     float fov   = 39.3076f * pi / 180.0f;
     //float fov   = 60.0f * pi / 180.0f;
@@ -58,19 +300,120 @@ int main(int argc, char** argv)
 
     Renderer renderer(height, width, spp, path_depth);
 
-    renderer.set_mesh(mesh);
+    renderer.use_wide_bvh(use_wide_bvh);
+    renderer.use_packets(use_packets);
+    renderer.batch_shadow_rays(batch_shadows);
+    renderer.use_wavefront(use_wavefront);
+    renderer.set_rr_depth(rr_depth);
+    renderer.set_tiles(tile_size, tile_order);
+    renderer.set_tile_stats(tile_stats);
+    renderer.set_adaptive(adaptive_threshold, adaptive_base_spp);
+    if (sampler_method != Sampler::OWEN_SOBOL)
+        renderer.set_sampler(sampler_method);
+    renderer.use_compressed_bvh(use_compressed_bvh);
+    renderer.set_bvh_method(bvh_method);
+    renderer.set_bvh_layout(bvh_layout);
+    renderer.set_bvh_cache(bvh_cache);
+    renderer.set_split_budget(split_budget);
+
+    Scene scene;
+    if (nb_instances > 1)
+    {
+        scene.use_wide_bvh(use_wide_bvh);
+        scene.set_bvh_method(bvh_method);
+        scene.set_bvh_layout(bvh_layout);
+        scene.set_split_budget(split_budget);
+        scene.set_bvh_cache(bvh_cache);
+        int mesh_id = scene.add_mesh(mesh);
+
+        float3 mini(1e32f), maxi(-1e32f);
+        for (auto &v : mesh.vertices())
+        {
+            mini = min(mini, v);
+            maxi = max(maxi, v);
+        }
+        float3 spacing = (maxi - mini) * 1.1f;
+
+        // the first instance is the mesh itself, the others go to its side and back
+        for (int k = 0; k < nb_instances * nb_instances; ++k)
+            scene.add_instance(mesh_id, eye(), float3((k % nb_instances) * spacing.x, 0.0f, (k / nb_instances) * spacing.z));
+
+        scene.build();
+        renderer.set_scene(scene);
+    }
+    else
+    {
+        renderer.set_mesh(mesh);
+    }
 
     renderer.set_camera(camera);
 
     std::cout << "done in " << timer.elapsed(1) * 1e-6 << "s." << std::endl;
 
-    renderer.render();
+    if (refit_frames > 0)
+    {
+        // a ripple across the mesh that grows with the frames, enough for the
+        // worst subtrees to be rebuilt instead of only refit
+        std::vector<float3> rest = mesh.vertices();
+        float3 mini(1e32f), maxi(-1e32f);
+        for (auto &v : rest)
+        {
+            mini = min(mini, v);
+            maxi = max(maxi, v);
+        }
+        float3 extent = maxi - mini;
 
-    std::cout << timer.elapsed() / 1e6f << "s elapsed." << std::endl;
+        int nb_rebuilt = 0;
+        double refit_time = 0.0;
+        renderer.set_verbose(false);
+        for (int frame = 1; frame <= refit_frames; ++frame)
+        {
+            float amplitude = 0.2f * extent.y * frame / refit_frames;
+            std::vector<float3> vertices(rest);
+            for (auto &v : vertices)
+                v.y += amplitude * std::sin(8.0f * pi * (v.x - mini.x) / extent.x);
+            mesh.set_vertices(vertices);
+
+            Timer refit_timer;
+            nb_rebuilt += renderer.update_mesh();
+            refit_time += refit_timer.elapsed() * 1e-6;
+        }
+        renderer.set_verbose(true);
+
+        std::cout << refit_frames << " frames refit in " << refit_time << "s | " << refit_time / refit_frames * 1e3 << "ms per frame | "
+                  << nb_rebuilt << " subtrees rebuilt" << std::endl;
+        timer.reset();
+    }
 
     std::string out_file("out.ppm");
+
+    if (progressive && spp <= 0 && time_budget <= 0.0)
+    {
+        std::cerr << "A progressive render needs a sample count or a time budget" << std::endl;
+        return 1;
+    }
+
+    if (progressive)
+    {
+        // the writer is done with out.ppm once it goes out of scope
+        ImageWriter writer(out_file);
+        renderer.render_progressive(spp, time_budget, pass_spp, &writer, write_interval);
+    }
+    else
+    {
+        renderer.render();
+    }
+
+    std::cout << timer.elapsed() / 1e6f << "s elapsed." << std::endl;
+
     write_ppm(renderer.get_image(), height, width, out_file);
 
+    if (!heatmap_file.empty())
+    {
+        std::vector<float3> heatmap = renderer.sample_heatmap();
+        write_ppm(heatmap, height, width, heatmap_file);
+    }
+
     return 0;
 
 
@@ -20,6 +20,34 @@ mat3f eye(void) {
   return out;
 }
 
+mat3f transpose(const mat3f &m) {
+  mat3f out;
+  for (int i = 0; i < 3; ++i)
+    for (int j = 0; j < 3; ++j)
+      out.data[3 * i + j] = m.data[3 * j + i];
+  return out;
+}
+
+// cofactors over the determinant, m must be invertible
+mat3f inverse(const mat3f &m) {
+  const float *a = m.data;
+  mat3f out;
+  out.data[0] = a[4] * a[8] - a[5] * a[7];
+  out.data[1] = a[2] * a[7] - a[1] * a[8];
+  out.data[2] = a[1] * a[5] - a[2] * a[4];
+  out.data[3] = a[5] * a[6] - a[3] * a[8];
+  out.data[4] = a[0] * a[8] - a[2] * a[6];
+  out.data[5] = a[2] * a[3] - a[0] * a[5];
+  out.data[6] = a[3] * a[7] - a[4] * a[6];
+  out.data[7] = a[1] * a[6] - a[0] * a[7];
+  out.data[8] = a[0] * a[4] - a[1] * a[3];
+
+  float det = a[0] * out.data[0] + a[1] * out.data[3] + a[2] * out.data[6];
+  for (int i = 0; i < 9; ++i)
+    out.data[i] /= det;
+  return out;
+}
+
 float wrap(const float f)
 {
     return f > 1.0f ? f - 1.0f : f;
@@ -72,6 +72,7 @@ struct float3
 
 inline float3 max(float3 lhs, float3 rhs) { return float3(std::max(lhs.x, rhs.x), std::max(lhs.y, rhs.y), std::max(lhs.z, rhs.z)); }
 inline float3 min(float3 lhs, float3 rhs) { return float3(std::min(lhs.x, rhs.x), std::min(lhs.y, rhs.y), std::min(lhs.z, rhs.z)); }
+inline float  luminance(const float3 &c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
 
 template<typename T>
 inline void swap(T& a, T& b) { T t = a; a = b; b = t; }
@@ -115,7 +116,7 @@ struct mat3f
         return out;
     }
 
-    inline float3 dot(float3& f) {
+    inline float3 dot(const float3& f) const {
         float3 out(0.0f);
         for (int i = 0; i < 3; ++i)
             for (int j = 0; j < 3; ++j)
@@ -135,6 +136,8 @@ struct mat3f
 };
 
 mat3f eye(void);
+mat3f transpose(const mat3f &m);
+mat3f inverse(const mat3f &m);
 
 float wrap(const float f);
 
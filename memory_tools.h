@@ -0,0 +1,34 @@
+#ifndef MEMORY_TOOLS_H
+#define MEMORY_TOOLS_H
+
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+
+// std::vector only honours alignof(T) <= 16 before C++17, so SIMD-friendly
+// nodes are stored through this allocator instead.
+template <typename T, size_t Alignment>
+struct aligned_allocator
+{
+    typedef T value_type;
+
+    template <typename U> struct rebind { typedef aligned_allocator<U, Alignment> other; };
+
+    aligned_allocator() {}
+    template <typename U> aligned_allocator(const aligned_allocator<U, Alignment>&) {}
+
+    inline T* allocate(size_t n)
+    {
+        void *p = nullptr;
+        if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0)
+            throw std::bad_alloc();
+        return (T*) p;
+    }
+
+    inline void deallocate(T *p, size_t) { std::free(p); }
+
+    template <typename U> inline bool operator==(const aligned_allocator<U, Alignment>&) const { return true;  }
+    template <typename U> inline bool operator!=(const aligned_allocator<U, Alignment>&) const { return false; }
+};
+
+#endif // MEMORY_TOOLS_H
@@ -31,6 +31,50 @@ Hit Mesh::intersect(const ray &r, float t_min, float t_max)
     return Hit(did_hit, min_depth, face_id);
 }
 
+// FNV-1a over the face geometry, 32 bits at a time
+uint64_t Mesh::hash(void) const
+{
+    uint64_t h = 14695981039346656037ULL;
+    auto hash_word = [&](uint32_t w) { h = (h ^ w) * 1099511628211ULL; };
+
+    hash_word(m_vertices.size());
+    hash_word(m_faces.size());
+
+    const uint32_t *words = (const uint32_t*) m_triangles.data();
+    size_t nb_words = m_triangles.size() * sizeof(Triangle) / sizeof(uint32_t);
+    for (size_t i = 0; i < nb_words; ++i)
+        hash_word(words[i]);
+
+    for (auto &face : m_faces)
+    {
+        hash_word(face.v_id.x);
+        hash_word(face.v_id.y);
+        hash_word(face.v_id.z);
+    }
+
+    return h;
+}
+
+void Mesh::set_vertices(const std::vector<float3> &vertices)
+{
+    m_vertices = vertices;
+    update_triangles();
+}
+
+void Mesh::update_triangles(void)
+{
+    int nb_faces = m_faces.size();
+
+#pragma omp parallel for schedule(static, 4096)
+    for (int i = 0; i < nb_faces; ++i)
+    {
+        int3 v_id = m_faces[i].v_id;
+        m_triangles[i] = Triangle(m_vertices[v_id.x], m_vertices[v_id.y], m_vertices[v_id.z]);
+        m_centroids[i] = m_triangles[i].centroid();
+            m_areas[i] = m_triangles[i].area();
+    }
+}
+
 Mesh read_ply(const char* file_path)
 {
     enum Read_mode {ASCII, BINARY, ELSE};
@@ -272,9 +316,12 @@ Mesh read_obj(const char* file_path)
                     {
                         int c_idx = std::atoi(index_string[j].c_str());
 
+                        // relative indices count back from the last v, vt or vn
+                        // read, by their position in the v/vt/vn triple
                         if (c_idx < 0)
                         {
-                            indices.push_back(vertices.size() + c_idx);
+                            int nb_elements = j == 0 ? vertices.size() : (j == 1 ? texture_coordinates.size() : normals.size());
+                            indices.push_back(nb_elements + c_idx);
                         }
                         else
                         {
@@ -340,7 +387,7 @@ Mesh read_obj(const char* file_path)
             if (is_quad)
                 faces.push_back(face2);
 
-            if (materials[face.m_id].is_emissive)
+            if (face.m_id >= 0 && materials[face.m_id].is_emissive)
             {
                 e_faces_indices.push_back(faces.size() - 1);
 
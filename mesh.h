@@ -2,6 +2,7 @@
 #define MESH_H
 
 #include <vector>
+#include <cstdint>
 
 #include "math_tools.h"
 #include "geometry.h"
@@ -19,8 +20,13 @@ class Mesh {
 public:
     Mesh() {}
     inline Mesh(std::vector<float3> vertices, std::vector<float2> tex_coords, std::vector<float3> normals, std::vector<Face> faces, std::vector<int> e_faces, std::vector<Material> materials)
-        : m_vertices(vertices), m_tex_coords(tex_coords), m_normals(normals), m_faces(faces), m_e_faces_indices(e_faces), m_materials(materials)
+        : m_vertices(std::move(vertices)), m_tex_coords(std::move(tex_coords)), m_normals(std::move(normals)),
+          m_faces(std::move(faces)), m_e_faces_indices(std::move(e_faces)), m_materials(std::move(materials))
     {
+        m_triangles.reserve(m_faces.size());
+        m_centroids.reserve(m_faces.size());
+        m_areas.reserve(m_faces.size());
+
         for (size_t i = 0; i < m_faces.size(); ++i)
         {
             int3 v_id = m_faces[i].v_id;
@@ -35,6 +41,7 @@ public:
     inline       Triangle&              triangle(int i)       { return m_triangles[i]; }
     inline       std::vector<Triangle>& triangles()       { return m_triangles;    }
     inline       std::vector<Face>&     faces()           { return m_faces; }
+    inline       std::vector<float3>&   vertices()        { return m_vertices;     }
     //inline const std::vector<Triangle>& faces() const { return m_faces; }
 
     inline int nb_vertices(void) const  { return m_vertices.size();      }
@@ -53,6 +60,13 @@ public:
 
     Hit intersect(const ray &r, float t_min = 0.0f, float t_max = 1e20f);
 
+    uint64_t hash(void) const;
+
+    // for deforming meshes: the faces keep their vertex indices, triangles,
+    // centroids and areas are recomputed from the new positions
+    void set_vertices(const std::vector<float3> &vertices);
+    void update_triangles(void);
+
     inline float3 face_normal(int i, float3 &p)
     {
         if (m_faces[i].n_id.x >= 0)
@@ -104,6 +118,9 @@ private:
 
 Mesh read_ply(const char* file_path);
 Mesh read_obj(const char* file_path);
+// maps the file and parses chunks of lines in parallel, then merges them in file
+// order; falls back to read_obj if the file cannot be mapped
+Mesh read_obj_parallel(const char* file_path);
 std::vector<Material> read_mtl(const char* file_path);
 
 #endif
@@ -0,0 +1,411 @@
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+#include "mesh.h"
+#include "file_tools.h"
+#include "string_tools.h"
+#include "task_pool.h"
+
+// bytes of the file parsed by one task, cut at the next line end
+#define OBJ_CHUNK_SIZE (1 << 22)
+
+// mtllib or usemtl line of a chunk, which depends on the chunks before it and
+// is applied in order during the merge from the face that follows it
+struct ObjEvent
+{
+    int         face;
+    bool        is_library;
+    std::string name;
+};
+
+// what a chunk of lines holds; its negative indices count back from the end of the
+// chunk's own lists and are marked to be moved by the size of the chunks before it
+struct ObjChunk
+{
+    std::vector<float3> vertices;
+    std::vector<float2> texture_coordinates;
+    std::vector<float3> normals;
+    std::vector<Face>   faces;
+
+    // face, then bit 3 * kind + k set if index k of its vertices, uvs or normals is relative
+    std::vector<std::pair<int, int> > relative_faces;
+    std::vector<ObjEvent>             events;
+};
+
+static inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static inline void skip_spaces(const char *&p, const char *end)
+{
+    while (p < end && is_space(*p))
+        ++p;
+}
+
+// the token at p, which then points past it
+static inline std::string next_token(const char *&p, const char *end)
+{
+    skip_spaces(p, end);
+    const char *begin = p;
+    while (p < end && !is_space(*p))
+        ++p;
+    return std::string(begin, p);
+}
+
+static inline int parse_int(const char *&p, const char *end)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    int value = 0;
+    while (p < end && is_digit(*p))
+        value = value * 10 + (*p++ - '0');
+
+    return negative ? -value : value;
+}
+
+// decimal and exponent notations, the 19 first significant digits are kept
+// exactly and scaled once by a power of ten
+static inline float parse_float(const char *&p, const char *end)
+{
+    static const double powers_of_10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                          1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    skip_spaces(p, end);
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int      exponent = 0;
+    int      nb_digits = 0;
+
+    for (; p < end && is_digit(*p); ++p)
+    {
+        if (nb_digits < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            nb_digits += mantissa > 0;
+        }
+        else
+        {
+            exponent++;
+        }
+    }
+
+    if (p < end && *p == '.')
+    {
+        for (++p; p < end && is_digit(*p); ++p)
+        {
+            if (nb_digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                nb_digits += mantissa > 0;
+                exponent--;
+            }
+        }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        ++p;
+        exponent += parse_int(p, end);
+    }
+
+    double value = mantissa;
+    int    e     = std::abs(exponent);
+    double scale = e <= 22 ? powers_of_10[e] : std::pow(10.0, e);
+    value = exponent < 0 ? value / scale : value * scale;
+
+    return negative ? -value : value;
+}
+
+// index in the list counted so far, sets bit of relative_mask if it counts back from its end
+static inline int parse_index(const char *&p, const char *end, int count, int bit, int &relative_mask)
+{
+    int index = parse_int(p, end);
+    if (index < 0)
+    {
+        relative_mask |= 1 << bit;
+        return count + index;
+    }
+    return index - 1;
+}
+
+// relative bits of the triangle of vertices a, b and c of a face, from those of its
+// vertices at bit 4 * kind + vertex
+static inline int triangle_mask(int vertex_mask, int a, int b, int c)
+{
+    int vertices[3] = {a, b, c};
+
+    int mask = 0;
+    for (int kind = 0; kind < 3; ++kind)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            if ((vertex_mask >> (4 * kind + vertices[k])) & 1)
+                mask |= 1 << (3 * kind + k);
+        }
+    }
+    return mask;
+}
+
+// triangles and quads as read_obj, which keeps the first triangle of larger
+// polygons, indices of the form v, v/t, v//n or v/t/n
+static void parse_face(const char *p, const char *end, ObjChunk &chunk)
+{
+    int  v[4], t[4], n[4];
+    bool has_uv = false, has_normals = false;
+    int  relative_mask = 0;
+    int  nb_face_vertices = 0;
+
+    while (true)
+    {
+        skip_spaces(p, end);
+        if (p >= end)
+            break;
+
+        // only counted
+        if (nb_face_vertices >= 4)
+        {
+            while (p < end && !is_space(*p))
+                ++p;
+            nb_face_vertices++;
+            continue;
+        }
+
+        int k = nb_face_vertices;
+        v[k] = parse_index(p, end, chunk.vertices.size(), k, relative_mask);
+        t[k] = n[k] = -1;
+
+        if (p < end && *p == '/')
+        {
+            ++p;
+            if (p < end && *p != '/' && !is_space(*p))
+            {
+                t[k] = parse_index(p, end, chunk.texture_coordinates.size(), 4 + k, relative_mask);
+                has_uv |= k == 0;
+            }
+            if (p < end && *p == '/')
+            {
+                ++p;
+                n[k] = parse_index(p, end, chunk.normals.size(), 8 + k, relative_mask);
+                has_normals |= k == 0;
+            }
+        }
+
+        // skips what is left of the vertex
+        while (p < end && !is_space(*p))
+            ++p;
+
+        nb_face_vertices++;
+    }
+
+    if (nb_face_vertices < 3)
+        return;
+
+    bool is_quad   = nb_face_vertices == 4;
+    int  face_mask = triangle_mask(relative_mask, 0, 1, 2);
+    int  quad_mask = triangle_mask(relative_mask, 2, 3, 0);
+
+    Face face;
+    face.v_id = int3(v[0], v[1], v[2]);
+    if (has_uv)      face.t_id = int3(t[0], t[1], t[2]);
+    if (has_normals) face.n_id = int3(n[0], n[1], n[2]);
+
+    chunk.faces.push_back(face);
+    if (face_mask)
+        chunk.relative_faces.push_back(std::make_pair((int) chunk.faces.size() - 1, face_mask));
+
+    if (is_quad)
+    {
+        Face face2;
+        face2.v_id = int3(v[2], v[3], v[0]);
+        if (has_uv)      face2.t_id = int3(t[2], t[3], t[0]);
+        if (has_normals) face2.n_id = int3(n[2], n[3], n[0]);
+
+        chunk.faces.push_back(face2);
+        if (quad_mask)
+            chunk.relative_faces.push_back(std::make_pair((int) chunk.faces.size() - 1, quad_mask));
+    }
+}
+
+static void parse_chunk(const char *begin, const char *end, ObjChunk &chunk)
+{
+    const char *line = begin;
+    while (line < end)
+    {
+        const char *line_end = (const char*) std::memchr(line, '\n', end - line);
+        if (!line_end)
+            line_end = end;
+
+        const char *p = line;
+        skip_spaces(p, line_end);
+
+        const char *keyword = p;
+        while (p < line_end && !is_space(*p))
+            ++p;
+        size_t length = p - keyword;
+
+        if (length == 1 && keyword[0] == 'v')
+        {
+            float x = parse_float(p, line_end);
+            float y = parse_float(p, line_end);
+            float z = parse_float(p, line_end);
+            chunk.vertices.push_back(float3(x, y, z));
+        }
+        else if (length == 2 && keyword[0] == 'v' && keyword[1] == 't')
+        {
+            float u = parse_float(p, line_end);
+            float v = parse_float(p, line_end);
+            chunk.texture_coordinates.push_back(float2(u, v));
+        }
+        else if (length == 2 && keyword[0] == 'v' && keyword[1] == 'n')
+        {
+            float x = parse_float(p, line_end);
+            float y = parse_float(p, line_end);
+            float z = parse_float(p, line_end);
+            chunk.normals.push_back(float3(x, y, z));
+        }
+        else if (length == 1 && keyword[0] == 'f')
+        {
+            parse_face(p, line_end, chunk);
+        }
+        else if (length == 6 && (std::strncmp(keyword, "usemtl", 6) == 0 || std::strncmp(keyword, "mtllib", 6) == 0))
+        {
+            ObjEvent event;
+            event.face       = chunk.faces.size();
+            event.is_library = keyword[0] == 'm';
+            event.name       = next_token(p, line_end);
+            chunk.events.push_back(event);
+        }
+
+        line = line_end + 1;
+    }
+}
+
+Mesh read_obj_parallel(const char* file_path)
+{
+    MappedFile file(file_path);
+    if (!file.is_open())
+        return read_obj(file_path);
+
+    const char *data = file.data();
+    size_t      size = file.size();
+
+    // chunks start after the line end that follows their nominal start
+    int nb_chunks = std::max<size_t>(1, (size + OBJ_CHUNK_SIZE - 1) / OBJ_CHUNK_SIZE);
+    std::vector<const char*> bounds(nb_chunks + 1, data + size);
+    bounds[0] = data;
+    for (int c = 1; c < nb_chunks; ++c)
+    {
+        const char *start = std::max(data + (size_t) c * OBJ_CHUNK_SIZE, bounds[c - 1]);
+        const char *line_end = (const char*) std::memchr(start, '\n', data + size - start);
+        bounds[c] = line_end ? line_end + 1 : data + size;
+    }
+
+    std::vector<ObjChunk> chunks(nb_chunks);
+    TaskPool::global().parallel_for(0, nb_chunks, 1, [&](int begin, int end) {
+        for (int c = begin; c < end; ++c)
+            parse_chunk(bounds[c], bounds[c + 1], chunks[c]);
+    });
+
+    // offsets of the chunks in the merged lists
+    std::vector<int> v_offsets(nb_chunks + 1, 0), t_offsets(nb_chunks + 1, 0);
+    std::vector<int> n_offsets(nb_chunks + 1, 0), f_offsets(nb_chunks + 1, 0);
+    for (int c = 0; c < nb_chunks; ++c)
+    {
+        v_offsets[c + 1] = v_offsets[c] + chunks[c].vertices.size();
+        t_offsets[c + 1] = t_offsets[c] + chunks[c].texture_coordinates.size();
+        n_offsets[c + 1] = n_offsets[c] + chunks[c].normals.size();
+        f_offsets[c + 1] = f_offsets[c] + chunks[c].faces.size();
+    }
+
+    // materials in file order, as (first face, material) runs of each chunk
+    std::string raw_path = strip_filename(std::string(file_path));
+
+    std::vector<Material> materials;
+    std::vector<std::vector<std::pair<int, int> > > material_runs(nb_chunks);
+    int current_material = -1;
+    for (int c = 0; c < nb_chunks; ++c)
+    {
+        material_runs[c].push_back(std::make_pair(0, current_material));
+        for (auto &event : chunks[c].events)
+        {
+            if (event.is_library)
+            {
+                std::string mtl_path = raw_path + "/" + event.name;
+                materials = read_mtl(mtl_path.c_str());
+                continue;
+            }
+
+            for (size_t i = 0; i < materials.size(); ++i)
+            {
+                if (event.name == materials[i].name)
+                {
+                    current_material = i;
+                    break;
+                }
+            }
+            material_runs[c].push_back(std::make_pair(event.face, current_material));
+        }
+    }
+
+    std::vector<float3> vertices(v_offsets[nb_chunks]);
+    std::vector<float2> texture_coordinates(t_offsets[nb_chunks]);
+    std::vector<float3> normals(n_offsets[nb_chunks]);
+    std::vector<Face>   faces(f_offsets[nb_chunks]);
+
+    TaskPool::global().parallel_for(0, nb_chunks, 1, [&](int begin, int end) {
+        for (int c = begin; c < end; ++c)
+        {
+            ObjChunk &chunk = chunks[c];
+
+            std::copy(chunk.vertices.begin(),            chunk.vertices.end(),            vertices.begin()            + v_offsets[c]);
+            std::copy(chunk.texture_coordinates.begin(), chunk.texture_coordinates.end(), texture_coordinates.begin() + t_offsets[c]);
+            std::copy(chunk.normals.begin(),             chunk.normals.end(),             normals.begin()             + n_offsets[c]);
+
+            Face *chunk_faces = &faces[0] + f_offsets[c];
+            std::copy(chunk.faces.begin(), chunk.faces.end(), chunk_faces);
+
+            auto &runs = material_runs[c];
+            for (size_t r = 0; r < runs.size(); ++r)
+            {
+                int run_end = r + 1 < runs.size() ? runs[r + 1].first : (int) chunk.faces.size();
+                for (int f = runs[r].first; f < run_end; ++f)
+                    chunk_faces[f].m_id = runs[r].second;
+            }
+
+            for (auto &relative : chunk.relative_faces)
+            {
+                Face &face = chunk_faces[relative.first];
+                for (int k = 0; k < 3; ++k)
+                {
+                    if ((relative.second >> k) & 1)       face.v_id.data[k] += v_offsets[c];
+                    if ((relative.second >> (3 + k)) & 1) face.t_id.data[k] += t_offsets[c];
+                    if ((relative.second >> (6 + k)) & 1) face.n_id.data[k] += n_offsets[c];
+                }
+            }
+
+            // released as soon as merged
+            chunk = ObjChunk();
+        }
+    });
+
+    std::vector<int> e_faces_indices;
+    for (size_t f = 0; f < faces.size(); ++f)
+    {
+        if (faces[f].m_id >= 0 && materials[faces[f].m_id].is_emissive)
+            e_faces_indices.push_back(f);
+    }
+
+    std::cout << vertices.size() << " vertices" << std::endl;
+    std::cout << faces.size()    << " faces"    << std::endl;
+    std::cout << normals.size()  << " normals"  << std::endl;
+
+    return Mesh(std::move(vertices), std::move(texture_coordinates), std::move(normals), std::move(faces), std::move(e_faces_indices), std::move(materials));
+}
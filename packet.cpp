@@ -0,0 +1,170 @@
+#include "bvh.h"
+#include "simd_tools.h"
+
+#define RAY_PACKET_VECTORS (RAY_PACKET_SIZE / SIMD_WIDTH)
+#define SIMD_LANES_MASK    ((1 << SIMD_WIDTH) - 1)
+
+// lanes of mask whose ray enters bb before their t, and the closest entry among them
+static int intersect_packet_bb(const AABB &bb, const RayPacket &p, const float *t, int mask, float &t_near)
+{
+    alignas(32) float t_enter[RAY_PACKET_SIZE];
+    int hit_mask = 0;
+
+    for (int v = 0; v < RAY_PACKET_VECTORS; ++v)
+    {
+        int l = v * SIMD_WIDTH;
+
+        vfloat tx0 = v_mul(v_sub(v_set1(bb.mini.x), v_load(p.origin[0] + l)), v_load(p.inv_d[0] + l));
+        vfloat tx1 = v_mul(v_sub(v_set1(bb.maxi.x), v_load(p.origin[0] + l)), v_load(p.inv_d[0] + l));
+        vfloat ty0 = v_mul(v_sub(v_set1(bb.mini.y), v_load(p.origin[1] + l)), v_load(p.inv_d[1] + l));
+        vfloat ty1 = v_mul(v_sub(v_set1(bb.maxi.y), v_load(p.origin[1] + l)), v_load(p.inv_d[1] + l));
+        vfloat tz0 = v_mul(v_sub(v_set1(bb.mini.z), v_load(p.origin[2] + l)), v_load(p.inv_d[2] + l));
+        vfloat tz1 = v_mul(v_sub(v_set1(bb.maxi.z), v_load(p.origin[2] + l)), v_load(p.inv_d[2] + l));
+
+        // same NaN ordering as WideBVH::intersect_children
+        vfloat t0 = v_max(v_set1(0.0f),  v_max(v_max(v_min(tx0, tx1), v_min(ty0, ty1)), v_min(tz0, tz1)));
+        vfloat t1 = v_min(v_load(t + l), v_min(v_min(v_max(tx0, tx1), v_max(ty0, ty1)), v_max(tz0, tz1)));
+
+        v_store(t_enter + l, t0);
+        hit_mask |= v_mask(v_le(t0, t1)) << l;
+    }
+    hit_mask &= mask;
+
+    t_near = 1e32f;
+    for (int m = hit_mask; m; m &= m - 1)
+        t_near = std::min(t_near, t_enter[__builtin_ctz(m)]);
+
+    return hit_mask;
+}
+
+// tests the triangle of lane k of a block against SIMD_WIDTH rays at a time
+static void intersect_packet_triangle(const float (*v0)[SIMD_WIDTH], const float (*e0)[SIMD_WIDTH], const float (*e1)[SIMD_WIDTH], int k,
+                                      int face_id, const RayPacket &p, int mask, float *t, int *face_ids)
+{
+    vfloat tri_v0[3] = {v_set1(v0[0][k]), v_set1(v0[1][k]), v_set1(v0[2][k])};
+    vfloat tri_e0[3] = {v_set1(e0[0][k]), v_set1(e0[1][k]), v_set1(e0[2][k])};
+    vfloat tri_e1[3] = {v_set1(e1[0][k]), v_set1(e1[1][k]), v_set1(e1[2][k])};
+
+    for (int v = 0; v < RAY_PACKET_VECTORS; ++v)
+    {
+        int l = v * SIMD_WIDTH;
+        if (!((mask >> l) & SIMD_LANES_MASK))
+            continue;
+
+        vfloat o[3] = {v_load(p.origin[0] + l),    v_load(p.origin[1] + l),    v_load(p.origin[2] + l)};
+        vfloat d[3] = {v_load(p.direction[0] + l), v_load(p.direction[1] + l), v_load(p.direction[2] + l)};
+
+        vfloat t_lane = v_load(t + l);
+        vfloat d_hit;
+        vfloat hit = intersect_triangle_lanes(o, d, tri_v0, tri_e0, tri_e1, d_hit);
+        hit = v_and(hit, v_lt(d_hit, t_lane));
+
+        if (!v_mask(hit))
+            continue;
+
+        v_store(t + l, v_select(hit, d_hit, t_lane));
+        v_store_i(face_ids + l, v_select(hit, v_set1_i(face_id), v_load_i(face_ids + l)));
+    }
+}
+
+void BVH::intersect_packet(const RayPacket &packet, float *t_max, Hit *hits, TraversalStats *stats)
+{
+    const Node *nodes = node_data();
+
+    // inactive lanes get a negative t so that they never hit anything
+    alignas(32) float t[RAY_PACKET_SIZE];
+    alignas(32) int   face_ids[RAY_PACKET_SIZE];
+    for (int k = 0; k < RAY_PACKET_SIZE; ++k)
+    {
+        bool active = (packet.active >> k) & 1;
+        t[k]        = active ? t_max[k] : -1.0f;
+        face_ids[k] = -1;
+    }
+
+    if (stats)
+        stats->nb_rays += __builtin_popcount(packet.active);
+
+    struct StackEntry
+    {
+        int   node;
+        int   mask;
+        float t;
+    };
+
+    StackEntry nodes_stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+
+    float root_t;
+    int   root_mask = intersect_packet_bb(nodes[0].aabb, packet, t, packet.active, root_t);
+    if (root_mask)
+        nodes_stack[stack_size++] = {0, root_mask, root_t};
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = nodes_stack[--stack_size];
+
+        // the node is skipped once every ray that entered it hit something closer
+        float t_far = -1.0f;
+        for (int m = entry.mask; m; m &= m - 1)
+            t_far = std::max(t_far, t[__builtin_ctz(m)]);
+
+        if (entry.t >= t_far)
+            continue;
+
+        const Node &c_node = nodes[entry.node];
+
+        if (stats)
+            stats->nb_nodes += __builtin_popcount(entry.mask);
+
+        if (c_node.is_leaf())
+        {
+            if (stats)
+                stats->nb_faces += c_node.count * __builtin_popcount(entry.mask);
+
+            const TriangleBlock *block = &m_blocks[m_leaf_blocks[entry.node]];
+            for (int f = 0; f < c_node.count; ++f)
+            {
+                const TriangleBlock &b = block[f / SIMD_WIDTH];
+                int k = f % SIMD_WIDTH;
+                intersect_packet_triangle(b.v0, b.e0, b.e1, k, b.face_id[k], packet, entry.mask, t, face_ids);
+            }
+            continue;
+        }
+
+        int  first = c_node.offset;
+        int second = c_node.offset + 1;
+
+        float  first_t, second_t;
+        int  first_mask = intersect_packet_bb(nodes[ first].aabb, packet, t, entry.mask,  first_t);
+        int second_mask = intersect_packet_bb(nodes[second].aabb, packet, t, entry.mask, second_t);
+
+        if (first_mask && second_mask && first_t > second_t)
+        {
+            std::swap(first,      second);
+            std::swap(first_t,    second_t);
+            std::swap(first_mask, second_mask);
+        }
+
+        if (second_mask)
+            nodes_stack[stack_size++] = {second, second_mask, second_t};
+
+        if (first_mask)
+            nodes_stack[stack_size++] = {first, first_mask, first_t};
+    }
+
+    for (int k = 0; k < RAY_PACKET_SIZE; ++k)
+    {
+        if (!((packet.active >> k) & 1))
+            continue;
+
+        if (face_ids[k] >= 0)
+        {
+            hits[k]  = Hit(true, t[k], face_ids[k]);
+            t_max[k] = t[k];
+        }
+        else
+        {
+            hits[k] = Hit(false, 1e32f, -1);
+        }
+    }
+}
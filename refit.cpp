@@ -0,0 +1,225 @@
+#include <iostream>
+#include <algorithm>
+
+#include "bvh.h"
+#include "time_tools.h"
+
+int BVH::refit(float rebuild_threshold, bool verbose)
+{
+    Timer timer;
+
+    detach();
+
+    bool rebuild = rebuild_threshold > 0.0f;
+
+    std::vector<float> costs(rebuild ? m_nb_nodes : 0);
+    refit_node(0, 0, rebuild ? costs.data() : nullptr, true);
+
+    std::vector<std::pair<int, int> > subtrees;
+    if (rebuild)
+        find_degraded(0, 0, rebuild_threshold, costs.data(), subtrees);
+
+    // a subtree is rebuilt over the index range of its leaves, which must not
+    // hold the faces of other leaves; the whole tree is built again otherwise
+    std::vector<std::pair<int, int> > ranges(subtrees.size());
+    for (size_t k = 0; k < subtrees.size(); ++k)
+    {
+        if (!subtree_range(subtrees[k].first, ranges[k].first, ranges[k].second))
+        {
+            std::cout << "BVH refit | the faces of a subtree are not contiguous, building the BVH again" << std::endl;
+            build();
+            return 1;
+        }
+    }
+
+    if (!subtrees.empty())
+    {
+        // the rebuilt subtrees take new nodes from per-thread chunks at the end
+        // of m_nodes, the whole tree is then laid out again without the old ones
+        int nb_new_nodes = 0;
+        for (size_t k = 0; k < subtrees.size(); ++k)
+        {
+            auto &subtree   = subtrees[k];
+            int start_index = ranges[k].first;
+            int end_index   = ranges[k].second;
+
+            m_nodes[subtree.first].offset = start_index;
+            m_nodes[subtree.first].count  = end_index - start_index;
+            m_build_costs[subtree.first]  = -1.0f;
+
+            nb_new_nodes += 2 * (end_index - start_index);
+        }
+
+        int nb_old_nodes = m_nb_nodes;
+
+        m_chunks.assign(TaskPool::global().nb_threads() + 1, NodeChunk());
+        m_nodes.resize(m_nb_nodes + nb_new_nodes + m_chunks.size() * BVH_NODE_CHUNK_SIZE);
+
+        TaskGroup group;
+        for (auto &subtree : subtrees)
+        {
+            group.run([this, subtree]() {
+                rebuild_subtree(subtree.first, subtree.second);
+            });
+        }
+        group.wait();
+        m_chunks.clear();
+
+        std::vector<int> old_indices;
+        relayout_nodes(m_node_layout, old_indices);
+
+        // untouched nodes keep their build-time cost, rebuilt ones start over
+        costs.resize(m_nb_nodes);
+        refit_node(0, 0, costs.data(), false);
+
+        std::vector<float> build_costs(m_nb_nodes);
+        for (int i = 0; i < m_nb_nodes; ++i)
+        {
+            int old_index = old_indices[i];
+            bool is_old   = old_index < nb_old_nodes && m_build_costs[old_index] >= 0.0f;
+            build_costs[i] = is_old ? m_build_costs[old_index] : costs[i];
+        }
+        m_build_costs.swap(build_costs);
+    }
+
+    build_blocks();
+
+    if (verbose)
+        std::cout << "BVH refit in " << timer.elapsed() * 1e-6 << "s | " << subtrees.size() << " subtrees rebuilt | SAH cost " << tree_cost() << std::endl;
+
+    return (int) subtrees.size();
+}
+
+// index range covered by the leaves of the subtree, false if these leaves do
+// not cover the whole range
+bool BVH::subtree_range(int root, int &start_index, int &end_index)
+{
+    int nb_indices = 0;
+    start_index = m_nb_indices;
+    end_index   = 0;
+
+    std::vector<int> stack(1, root);
+    while (!stack.empty())
+    {
+        const Node &node = m_nodes[stack.back()];
+        stack.pop_back();
+
+        if (node.is_leaf())
+        {
+            start_index = std::min(start_index, node.offset);
+            end_index   = std::max(end_index,   node.offset + node.count);
+            nb_indices += node.count;
+            continue;
+        }
+
+        stack.push_back(node.offset);
+        stack.push_back(node.offset + 1);
+    }
+
+    return nb_indices == end_index - start_index;
+}
+
+// the costs of the tree with the bounds it was built with, the reference of refit
+void BVH::record_build_costs(void)
+{
+    m_build_costs.resize(m_nb_nodes);
+    refit_node(0, 0, m_build_costs.data(), false);
+}
+
+// returns the unnormalized SAH cost of the subtree, and stores the normalized
+// cost of each node in costs if given; the bounds of an SBVH leaf grow back to
+// the full bounds of its faces; only a detached tree can update its bounds
+float BVH::refit_node(int current_node, int depth, float *costs, bool update_bounds)
+{
+    const Node &node = node_data()[current_node];
+    float cost;
+
+    if (node.is_leaf())
+    {
+        if (update_bounds)
+            m_nodes[current_node].aabb = compute_face_bb(node.offset, node.offset + node.count);
+
+        cost = SAH_INTERSECTION_COST * node.aabb.surface() * node.count;
+    }
+    else
+    {
+        float left_cost, right_cost;
+        if (depth < BVH_REFIT_TASK_DEPTH)
+        {
+            TaskGroup group;
+            group.run([&]() {
+                left_cost = refit_node(node.offset, depth + 1, costs, update_bounds);
+            });
+            right_cost = refit_node(node.offset + 1, depth + 1, costs, update_bounds);
+            group.wait();
+        }
+        else
+        {
+            left_cost  = refit_node(node.offset,     depth + 1, costs, update_bounds);
+            right_cost = refit_node(node.offset + 1, depth + 1, costs, update_bounds);
+        }
+
+        if (update_bounds)
+        {
+            m_nodes[current_node].aabb = m_nodes[node.offset].aabb;
+            m_nodes[current_node].aabb.extend(m_nodes[node.offset + 1].aabb);
+        }
+
+        cost = SAH_TRAVERSAL_COST * node.aabb.surface() + left_cost + right_cost;
+    }
+
+    if (costs)
+    {
+        float surface = node.aabb.surface();
+        costs[current_node] = surface > 0.0f ? cost / surface : 0.0f;
+    }
+
+    return cost;
+}
+
+// collects the (node, depth) of the degraded subtrees, a degraded node with a
+// degraded child leaves the rebuild to its descendants
+void BVH::find_degraded(int current_node, int depth, float rebuild_threshold, const float *costs, std::vector<std::pair<int, int> > &subtrees)
+{
+    auto is_degraded = [&](int i) {
+        return !m_nodes[i].is_leaf() && costs[i] > rebuild_threshold * m_build_costs[i];
+    };
+
+    if (!is_degraded(current_node))
+        return;
+
+    int left_index = m_nodes[current_node].offset;
+    if (!is_degraded(left_index) && !is_degraded(left_index + 1))
+    {
+        subtrees.push_back(std::make_pair(current_node, depth));
+        return;
+    }
+
+    find_degraded(left_index,     depth + 1, rebuild_threshold, costs, subtrees);
+    find_degraded(left_index + 1, depth + 1, rebuild_threshold, costs, subtrees);
+}
+
+// the node already holds the face range of the subtree as a leaf
+void BVH::rebuild_subtree(int current_node, int depth)
+{
+    Node &node = m_nodes[current_node];
+    int start_index = node.offset;
+    int end_index   = node.offset + node.count;
+
+    node.aabb = compute_face_bb(start_index, end_index);
+    build_tree(current_node, start_index, end_index, depth);
+}
+
+// copies a mapped cache into owned arrays so that the tree can be modified
+void BVH::detach(void)
+{
+    if (!m_mapping)
+        return;
+
+    m_nodes.assign(m_mapped_nodes, m_mapped_nodes + m_nb_nodes);
+    m_indices.assign(m_mapped_indices, m_mapped_indices + m_nb_indices);
+
+    m_mapping.reset();
+    m_mapped_nodes   = nullptr;
+    m_mapped_indices = nullptr;
+}
@@ -0,0 +1,116 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+#include "render_stats.h"
+
+void RenderStats::reset(int nb_threads, long long nb_samples, double time_budget)
+{
+    std::vector<Counters, aligned_allocator<Counters, 64> > counters(nb_threads);
+    m_counters.swap(counters);
+    m_nb_samples  = nb_samples;
+    m_time_budget = time_budget;
+    m_run_time    = 0.0;
+}
+
+void RenderStats::add(int thread_index, long long nb_samples, const TraversalStats &stats)
+{
+    Counters &c = m_counters[thread_index];
+
+    c.nb_samples      .fetch_add(nb_samples,             std::memory_order_relaxed);
+    c.nb_rays         .fetch_add(stats.nb_rays,          std::memory_order_relaxed);
+    c.nb_nodes        .fetch_add(stats.nb_nodes,         std::memory_order_relaxed);
+    c.nb_faces        .fetch_add(stats.nb_faces,         std::memory_order_relaxed);
+    c.nb_shadow_rays  .fetch_add(stats.nb_shadow_rays,   std::memory_order_relaxed);
+    c.nb_occluder_hits.fetch_add(stats.nb_occluder_hits, std::memory_order_relaxed);
+}
+
+TraversalStats RenderStats::total(long long *nb_samples) const
+{
+    TraversalStats stats;
+    long long samples = 0;
+
+    for (auto &c : m_counters)
+    {
+        samples                += c.nb_samples      .load(std::memory_order_relaxed);
+        stats.nb_rays          += c.nb_rays         .load(std::memory_order_relaxed);
+        stats.nb_nodes         += c.nb_nodes        .load(std::memory_order_relaxed);
+        stats.nb_faces         += c.nb_faces        .load(std::memory_order_relaxed);
+        stats.nb_shadow_rays   += c.nb_shadow_rays  .load(std::memory_order_relaxed);
+        stats.nb_occluder_hits += c.nb_occluder_hits.load(std::memory_order_relaxed);
+    }
+
+    if (nb_samples)
+        *nb_samples = samples;
+    return stats;
+}
+
+void RenderStats::start(bool report_progress)
+{
+    m_timer.reset();
+    m_stop = false;
+
+    if (report_progress)
+        m_reporter = std::thread(&RenderStats::report, this);
+}
+
+void RenderStats::stop(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop)
+            return;
+        m_stop = true;
+    }
+    m_wake.notify_all();
+
+    if (m_reporter.joinable())
+        m_reporter.join();
+
+    m_run_time = m_timer.elapsed() * 1e-6;
+}
+
+void RenderStats::report(void)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_wake.wait_for(lock, std::chrono::milliseconds(RENDER_STATS_INTERVAL_MS), [this]() { return m_stop; }))
+    {
+        long long      nb_samples;
+        TraversalStats stats   = total(&nb_samples);
+        double         seconds = m_timer.elapsed() * 1e-6;
+
+        // the nearest of the two bounds
+        double done = 0.0;
+        if (m_nb_samples > 0)
+            done = std::max(done, double(nb_samples) / m_nb_samples);
+        if (m_time_budget > 0.0)
+            done = std::min(std::max(done, seconds / m_time_budget), 1.0);
+
+        std::cout << "progress | " << std::fixed << std::setprecision(1) << 100.0 * done << "% | "
+                  << (stats.nb_rays + stats.nb_occluder_hits) / seconds * 1e-6 << " Mrays/s | ";
+        if (done > 0.0)
+            std::cout << seconds * (1.0 - done) / done << " s left";
+        else
+            std::cout << "? s left";
+        std::cout << std::defaultfloat << std::setprecision(6) << std::endl;
+    }
+}
+
+void RenderStats::print_summary(void) const
+{
+    long long      nb_samples;
+    TraversalStats stats = total(&nb_samples);
+
+    // the shadow rays blocked by the cached occluder are the only rays without a traversal
+    double rays = stats.nb_rays + stats.nb_occluder_hits;
+
+    std::cout << "stats {\"samples\": " << nb_samples
+              << ", \"rays\": "             << stats.nb_rays
+              << ", \"shadow_rays\": "      << stats.nb_shadow_rays
+              << ", \"occluder_hits\": "    << stats.nb_occluder_hits
+              << ", \"nodes\": "            << stats.nb_nodes
+              << ", \"faces\": "            << stats.nb_faces
+              << ", \"seconds\": "          << m_run_time
+              << ", \"rays_per_second\": "  << (m_run_time > 0.0 ? rays / m_run_time : 0.0)
+              << "}" << std::endl;
+}
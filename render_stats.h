@@ -0,0 +1,74 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "bvh.h"
+#include "memory_tools.h"
+#include "time_tools.h"
+
+// period of the progress lines of the reporter thread
+#define RENDER_STATS_INTERVAL_MS 1000
+
+// Progress and traversal counters of a render. Each thread adds to its own
+// cache line once per tile, with relaxed atomics since it is the only writer,
+// and the totals are only summed when they are read: by the reporter thread,
+// which prints the rate and the remaining time at a fixed interval, and by the
+// final summary.
+class RenderStats
+{
+    struct alignas(64) Counters
+    {
+        Counters() : nb_samples(0), nb_rays(0), nb_nodes(0), nb_faces(0), nb_shadow_rays(0), nb_occluder_hits(0) {}
+
+        std::atomic<long long> nb_samples; // pixel samples
+        std::atomic<long long> nb_rays;
+        std::atomic<long long> nb_nodes;
+        std::atomic<long long> nb_faces;
+        std::atomic<long long> nb_shadow_rays;
+        std::atomic<long long> nb_occluder_hits;
+    };
+
+public:
+    RenderStats() : m_nb_samples(0), m_time_budget(0.0), m_run_time(0.0), m_stop(false) {}
+    ~RenderStats() { stop(); }
+
+    // clears the counters of nb_threads threads for a render of nb_samples pixel
+    // samples or time_budget seconds, whichever ends first, 0 for no bound
+    void reset(int nb_threads, long long nb_samples, double time_budget = 0.0);
+
+    // from thread thread_index only, after it finished some pixel samples
+    void add(int thread_index, long long nb_samples, const TraversalStats &stats);
+
+    TraversalStats total(long long *nb_samples = nullptr) const;
+
+    // starts and stops the reporter thread, stop also ends the run time
+    void start(bool report_progress);
+    void stop(void);
+
+    inline double elapsed(void) const { return m_run_time; }
+
+    // one line of json after "stats " with the totals and the rates
+    void print_summary(void) const;
+
+private:
+    std::vector<Counters, aligned_allocator<Counters, 64> > m_counters;
+    long long m_nb_samples;
+    double    m_time_budget;
+
+    Timer  m_timer;
+    double m_run_time;
+
+    std::thread             m_reporter;
+    std::mutex              m_mutex;
+    std::condition_variable m_wake;
+    bool                    m_stop;
+
+    void report(void);
+};
+
+#endif // RENDER_STATS_H
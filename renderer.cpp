@@ -4,117 +4,439 @@
 
 void Renderer::render()
 {
+    // adaptive sampling decides between passes
+    int pass_spp = m_adaptive_threshold > 0.0f ? PROGRESSIVE_PASS_SPP : m_spp;
+    render_progressive(std::max(m_spp, 1), 0.0, pass_spp);
+}
+
+void Renderer::render_progressive(int target_spp, double time_budget, int pass_spp, ImageWriter *writer, double write_interval)
+{
+    TileScheduler scheduler(m_height, m_width, m_tile_size, m_tile_order);
 
-    float focal = m_height * m_camera->focal();
-    int it_done = 0;
-    int previous_percent = 0;
+    long long nb_pixels = (long long) m_height * m_width;
+    pass_spp = std::max(pass_spp, 1);
 
-#pragma omp parallel for shared(it_done, previous_percent) num_threads(12) schedule(static, 2)
-    for (int i = 0; i < m_height; ++i)
+    m_accumulation.assign(m_height * m_width, float3(0.0f));
+    m_luminance_sq.assign(m_height * m_width, 0.0f);
+    m_nb_samples = 0;
+
+    int nb_blocks = m_nb_block_rows * m_nb_block_cols;
+    m_block_samples.assign(nb_blocks, 0);
+    m_block_active.assign(nb_blocks, 1);
+
+    m_stats.reset(TaskPool::global().nb_threads() + 1, target_spp > 0 ? nb_pixels * target_spp : 0, time_budget);
+    m_stats.start(m_verbose);
+
+    Timer  timer, write_timer;
+    double pass_time = 0.0;
+    int    nb_passes = 0;
+
+    while (target_spp <= 0 || m_nb_samples < target_spp)
     {
-        for (int j = 0; j < m_width; ++j)
+        double elapsed = timer.elapsed() * 1e-6;
+        if (time_budget > 0.0 && nb_passes > 0 && elapsed + pass_time > time_budget)
+            break;
+
+        // the sampler goes on past the spp it was built for
+        int nb_samples = target_spp > 0 ? std::min(pass_spp, target_spp - m_nb_samples) : pass_spp;
+
+        Timer pass_timer;
+        render_pass(scheduler, m_nb_samples, nb_samples);
+        pass_time = pass_timer.elapsed() * 1e-6;
+
+        m_nb_samples += nb_samples;
+        nb_passes++;
+
+        if (m_adaptive_threshold > 0.0f && m_nb_samples >= m_adaptive_base_spp && update_adaptive() == 0)
+            break;
+
+        if (writer && write_timer.elapsed() * 1e-6 >= write_interval)
         {
-            float3 color(0.0f);
+            resolve_image();
+            writer->submit(m_image, m_height, m_width);
+            write_timer.reset();
+        }
+    }
 
-            for (int si = 0; si < m_spp; ++si)
-            {
-                float dx = m_sampler.get_sample(si, i, j, 0);
-                float dy = m_sampler.get_sample(si, i, j, 1);
+    resolve_image();
 
-                float3 direction;
-                direction.x = (j + dx - 0.5f * m_width)  / focal;
-                direction.y = (0.5f * m_height - i - dy) / focal;
-                direction.z = -1.0f;
-                direction.normalize();
+    m_stats.stop();
 
-                direction = m_camera->orientation().dot(direction);
+    if (m_verbose && nb_passes > 1)
+    {
+        std::cout << "progressive | " << m_nb_samples << " samples per pixel in " << nb_passes << " passes | "
+                  << timer.elapsed() * 1e-6 << " s" << std::endl;
+    }
 
-                ray r(m_camera->position(), direction);
+    if (m_verbose && m_adaptive_threshold > 0.0f)
+    {
+        long long nb_block_samples = 0;
+        int       nb_converged     = 0;
+        for (int b = 0; b < nb_blocks; ++b)
+        {
+            nb_block_samples += m_block_samples[b];
+            nb_converged     += !m_block_active[b];
+        }
+        std::cout << "adaptive | " << double(nb_block_samples) / nb_blocks << " samples per pixel on average | "
+                  << 100.0 * nb_converged / nb_blocks << "% of the blocks converged" << std::endl;
+    }
 
-                float3 path_color = sample_ray(r, 0, si, i, j);
+    TraversalStats stats = m_stats.total();
 
-                color += path_color;
-            }
+    if (m_verbose && stats.nb_rays > 0)
+    {
+        double nb_rays = stats.nb_rays;
+        std::cout << "traversal | " << stats.nb_rays << " rays | "
+                  << stats.nb_nodes / nb_rays << " nodes / ray | "
+                  << stats.nb_faces / nb_rays << " faces / ray" << std::endl;
+    }
+
+    if (m_verbose && stats.nb_shadow_rays > 0)
+    {
+        std::cout << "shadow rays | " << stats.nb_shadow_rays << " rays | "
+                  << 100.0 * stats.nb_occluder_hits / stats.nb_shadow_rays << "% blocked by the last occluder" << std::endl;
+    }
 
-            if (m_verbose)
-#pragma omp critical
+    if (m_verbose)
+    {
+        scheduler.print_stats();
+        m_stats.print_summary();
+    }
+    if (!m_tile_stats_path.empty())
+        scheduler.save_stats(m_tile_stats_path);
+}
+
+void Renderer::render_pass(TileScheduler &scheduler, int first_sample, int nb_samples)
+{
+    if (m_use_wavefront)
+        render_wavefront(scheduler, first_sample, nb_samples);
+    else
+        render_paths(scheduler, first_sample, nb_samples);
+
+    for (size_t b = 0; b < m_block_samples.size(); ++b)
+    {
+        if (m_block_active[b])
+            m_block_samples[b] += nb_samples;
+    }
+}
+
+// averages the samples of each pixel into the gamma corrected image
+void Renderer::resolve_image(void)
+{
+    TaskPool::global().parallel_for(0, m_height, 1, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            for (int j = 0; j < m_width; ++j)
             {
-                it_done += 1;
+                float inv_nb_samples = 1.0f / std::max(m_block_samples[block_index(i, j)], 1);
+                m_image[i * m_width + j] = (m_accumulation[i * m_width + j] * inv_nb_samples) ^ (1.0f / 2.2f);
+            }
+        }
+    });
+}
 
-                int percent_done = std::floor(10 * it_done / (m_height * m_width));
-                if (percent_done - previous_percent == 1 )
+// standard error of the mean luminance of each pixel from its samples, relative to
+// that mean; a block converges once the root mean square of its errors is below the
+// threshold, which is steadier than the error of any single pixel
+int Renderer::update_adaptive(void)
+{
+    TaskPool::global().parallel_for(0, m_nb_block_rows, 1, [&](int begin, int end) {
+        for (int bi = begin; bi < end; ++bi)
+        {
+            for (int bj = 0; bj < m_nb_block_cols; ++bj)
+            {
+                int b = bi * m_nb_block_cols + bj;
+                if (!m_block_active[b])
+                    continue;
+
+                float n         = m_block_samples[b];
+                float error_sq  = 0.0f;
+                int   nb_pixels = 0;
+                for (int i = bi * RAY_PACKET_HEIGHT; i < std::min((bi + 1) * RAY_PACKET_HEIGHT, m_height); ++i)
                 {
-                    std::cout << 10 * percent_done << "% done" << std::endl;
-                    previous_percent = percent_done;
+                    for (int j = bj * RAY_PACKET_WIDTH; j < std::min((bj + 1) * RAY_PACKET_WIDTH, m_width); ++j)
+                    {
+                        float mean     = luminance(m_accumulation[i * m_width + j]) / n;
+                        float variance = std::max(m_luminance_sq[i * m_width + j] / n - mean * mean, 0.0f) * n / (n - 1.0f);
+                        float error    = std::sqrt(variance / n) / std::max(mean, ADAPTIVE_MIN_LUMINANCE);
+                        error_sq += error * error;
+                        nb_pixels++;
+                    }
                 }
+
+                if (std::sqrt(error_sq / nb_pixels) < m_adaptive_threshold)
+                    m_block_active[b] = 0;
             }
+        }
+    });
 
-            color /= m_spp;
+    int nb_active = 0;
+    for (char active : m_block_active)
+        nb_active += active;
+    return nb_active;
+}
 
-            m_image.at(i * m_width + j) = color ^ (1.0f / 2.2f);
+std::vector<float3> Renderer::sample_heatmap(void) const
+{
+    int max_samples = 1;
+    for (int n : m_block_samples)
+        max_samples = std::max(max_samples, n);
 
+    std::vector<float3> heatmap(m_height * m_width);
+    for (int i = 0; i < m_height; ++i)
+    {
+        for (int j = 0; j < m_width; ++j)
+        {
+            // black, red, yellow then white
+            float t = 3.0f * m_block_samples[block_index(i, j)] / max_samples;
+            heatmap[i * m_width + j] = float3(std::min(t, 1.0f), std::min(std::max(t - 1.0f, 0.0f), 1.0f), std::max(t - 2.0f, 0.0f));
+        }
+    }
+    return heatmap;
+}
+
+// traces the paths of each tile one after the other, the primary rays of each
+// block of pixels together as a packet
+void Renderer::render_paths(TileScheduler &scheduler, int first_sample, int nb_samples)
+{
+    std::vector<ShadowCache, aligned_allocator<ShadowCache, 64> > shadows(TaskPool::global().nb_threads() + 1);
+
+    scheduler.run([&](const Tile &tile, int thread_index) {
+        TraversalStats stats;
+        long long      nb_pixel_samples = 0;
+
+        for (int bi = tile.i0 / RAY_PACKET_HEIGHT; bi < (tile.i1 + RAY_PACKET_HEIGHT - 1) / RAY_PACKET_HEIGHT; ++bi)
+        {
+            for (int bj = tile.j0 / RAY_PACKET_WIDTH; bj < (tile.j1 + RAY_PACKET_WIDTH - 1) / RAY_PACKET_WIDTH; ++bj)
+                nb_pixel_samples += render_block(bi, bj, first_sample, nb_samples, stats, shadows[thread_index]);
         }
 
+        m_stats.add(thread_index, nb_pixel_samples, stats);
+    });
+}
+
+// returns the number of pixel samples traced, none if the block converged
+int Renderer::render_block(int bi, int bj, int first_sample, int nb_samples, TraversalStats &stats, ShadowCache &shadows)
+{
+    if (!m_block_active[bi * m_nb_block_cols + bj])
+        return 0;
+
+    float focal    = m_height * m_camera->focal();
+    bool  adaptive = m_adaptive_threshold > 0.0f;
+
+    float3 colors[RAY_PACKET_SIZE];
+    float  luminance_sq[RAY_PACKET_SIZE];
+    for (int k = 0; k < RAY_PACKET_SIZE; ++k)
+    {
+        colors[k]       = float3(0.0f);
+        luminance_sq[k] = 0.0f;
+    }
+
+    int nb_pixels = 0;
+    for (int si = first_sample; si < first_sample + nb_samples; ++si)
+    {
+        RayPacket packet;
+        float     t_max[RAY_PACKET_SIZE];
+        Hit       hits[RAY_PACKET_SIZE];
+
+        for (int k = 0; k < RAY_PACKET_SIZE; ++k)
+        {
+            int i = bi * RAY_PACKET_HEIGHT + k / RAY_PACKET_WIDTH;
+            int j = bj * RAY_PACKET_WIDTH  + k % RAY_PACKET_WIDTH;
+            if (i >= m_height || j >= m_width)
+                continue;
+
+            float dx = m_sampler.get_sample(si, i, j, 0);
+            float dy = m_sampler.get_sample(si, i, j, 1);
+
+            float3 direction;
+            direction.x = (j + dx - 0.5f * m_width)  / focal;
+            direction.y = (0.5f * m_height - i - dy) / focal;
+            direction.z = -1.0f;
+            direction.normalize();
+
+            direction = m_camera->orientation().dot(direction);
+
+            packet.set(k, ray(m_camera->position(), direction));
+            t_max[k] = 1e10f;
+        }
+
+        nb_pixels = __builtin_popcount(packet.active);
+
+        if (m_max_nb_bounces <= 0)
+            continue;
+
+        intersect_packet(packet, t_max, hits, stats);
+
+        float3 sample_colors[RAY_PACKET_SIZE];
+        for (int k = 0; k < RAY_PACKET_SIZE; ++k)
+        {
+            sample_colors[k] = float3(0.0f);
+            if (!((packet.active >> k) & 1))
+                continue;
+
+            int i = bi * RAY_PACKET_HEIGHT + k / RAY_PACKET_WIDTH;
+            int j = bj * RAY_PACKET_WIDTH  + k % RAY_PACKET_WIDTH;
+
+            sample_colors[k] = trace_path(packet.get(k), hits[k], si, i, j, stats, shadows);
+        }
+
+        // the error estimate needs the whole value of each sample
+        if (m_batch_shadow_rays && adaptive)
+            trace_shadow_batch(shadows, sample_colors, stats);
+
+        for (int k = 0; k < RAY_PACKET_SIZE; ++k)
+        {
+            colors[k]       += sample_colors[k];
+            luminance_sq[k] += luminance(sample_colors[k]) * luminance(sample_colors[k]);
+        }
+    }
+
+    if (m_batch_shadow_rays)
+        trace_shadow_batch(shadows, colors, stats);
+
+    for (int k = 0; k < RAY_PACKET_SIZE; ++k)
+    {
+        int i = bi * RAY_PACKET_HEIGHT + k / RAY_PACKET_WIDTH;
+        int j = bj * RAY_PACKET_WIDTH  + k % RAY_PACKET_WIDTH;
+        if (i >= m_height || j >= m_width)
+            continue;
+
+        m_accumulation[i * m_width + j] += colors[k];
+        m_luminance_sq[i * m_width + j] += luminance_sq[k];
     }
 
+    return nb_pixels * nb_samples;
 }
 
-float3 Renderer::sample_ray(ray r, int sp, int sample_id, int i, int j)
+// follows a path from the hit of its camera ray, one segment per bounce
+float3 Renderer::trace_path(ray r, Hit hit, int sample_id, int i, int j, TraversalStats &stats, ShadowCache &shadows)
 {
-    float3 out_color(0.0f);
+    float3 radiance(0.0f);
+    float3 throughput(1.0f);
+
+    for (int sp = 0; sp < m_max_nb_bounces && hit; ++sp)
+    {
+        ShadowRay light_sample;
+        if (shade(r, hit, sp, sample_id, i, j, throughput, radiance, light_sample))
+        {
+            if (m_batch_shadow_rays)
+                shadows.batch.push_back(light_sample);
+            else if (!occluded(light_sample.r, light_sample.t_max, shadows, stats))
+                radiance += light_sample.contribution;
+        }
 
-    if (sp >= m_max_nb_bounces)
-        return out_color;
+        if (sp + 1 >= m_max_nb_bounces || !russian_roulette(throughput, sp, sample_id, i, j))
+            break;
 
-    float t_max = 1e10f;
-    Hit hit = m_bvh.intersect(r, t_max);
+        float t_max = 1e10f;
+        hit = intersect(r, t_max, stats);
+    }
 
-    if (!hit)
-        return out_color;
+    return radiance;
+}
 
+// adds the emission of the hit of segment sp to radiance and samples a light, both
+// weighted by the throughput of the path; r then becomes the next segment and the
+// throughput takes in the face color. Returns false if the light sample cannot contribute
+bool Renderer::shade(ray &r, const Hit &hit, int sp, int sample_id, int i, int j, float3 &throughput, float3 &radiance, ShadowRay &light_sample)
+{
     if (sp == 0)
-        out_color += m_mesh->face_material(hit.face_id).emission;
+        radiance += material(hit).emission * throughput;
 
     float3 p = r.origin + r.direction * hit.t;
-    float3 n = m_mesh->face_normal(hit.face_id, p);
+    float3 n = normal(hit, p);
 
     float r1_light = m_sampler.get_sample(sample_id, i, j, 2 + 4 * sp + 0);
     float r2_light = m_sampler.get_sample(sample_id, i, j, 2 + 4 * sp + 1);
     float  r1_path = m_sampler.get_sample(sample_id, i, j, 2 + 4 * sp + 2);
     float  r2_path = m_sampler.get_sample(sample_id, i, j, 2 + 4 * sp + 3);
 
-    int e_face_id = m_mesh->emissive_face_index(m_mesh->sample_emissive_face_id(r1_light));
+    Hit      e_hit      = sample_emissive_face(r1_light);
+    Triangle e_triangle = triangle(e_hit);
 
-    float3 light_point = m_mesh->triangle(e_face_id).sample_point(r1_light, r2_light);
+    float3 light_point = e_triangle.sample_point(r1_light, r2_light);
     float3 pa = p + n * m_scene_epsilon;
-    float3 e_n = m_mesh->face_normal(e_face_id, light_point);
+    float3 e_n = normal(e_hit, light_point);
     float3 pb = light_point + e_n * m_scene_epsilon;
 
 
     float3 light_direction = pb - pa;
     float light_t_max      = light_direction.norm();
     light_direction       /= light_t_max;
-    ray sr(pa, light_direction);
 
-    float3 face_color = m_mesh->face_material(hit.face_id).color;
+    float3 face_color = material(hit).color;
+    float  light_dp   = std::max(light_direction.dot(n), 0.0f);
 
-    bool viz = !m_bvh.visibility(sr, light_t_max);
-    if (viz)
+    // the light sample cannot contribute from below the surface, which also
+    // drops the NaN of degenerate faces
+    bool has_light_sample = light_dp > 0.0f;
+    if (has_light_sample)
     {
-        float3 light_color        = m_mesh->face_material(e_face_id).emission;
-        float  light_dp           = std::max(light_direction.dot(n), 0.0f);
-        float  light_pdf          = 1.0f / ( m_mesh->nb_emissive_faces() * m_mesh->area(e_face_id));
-        float  G                  = m_mesh->face_normal(e_face_id, pb).dot(light_direction * -1.0f) * light_dp / (light_t_max * light_t_max);
+        float3 light_color        = material(e_hit).emission;
+        float  light_pdf          = 1.0f / ( nb_emissive_faces() * e_triangle.area());
+        float  G                  = normal(e_hit, pb).dot(light_direction * -1.0f) * light_dp / (light_t_max * light_t_max);
         float3 light_contribution = face_color * light_dp * light_color * G / light_pdf;
-        out_color += min(light_contribution, max_sample_value);
+
+        light_sample.r            = ray(pa, light_direction);
+        light_sample.t_max        = light_t_max;
+        light_sample.contribution = min(light_contribution, max_sample_value) * throughput;
+        light_sample.pixel        = (i % RAY_PACKET_HEIGHT) * RAY_PACKET_WIDTH + j % RAY_PACKET_WIDTH;
+        light_sample.depth        = sp;
     }
 
-    float3 reflection_direction    = sample_around_normal(n, r1_path, r2_path);
-    float  reflection_dp           = std::max(reflection_direction.dot(n), 0.0f);
-    float3 reflection_pdf          = reflection_dp / pi;
-    float3 reflection_contribution = sample_ray(ray(pa, reflection_direction), sp + 1, sample_id, i, j) * face_color;
-    out_color += min(reflection_contribution, max_sample_value);
+    // cosine-weighted, so that the cosine and the pdf cancel out
+    r           = ray(pa, sample_around_normal(n, r1_path, r2_path));
+    throughput *= face_color;
+
+    return has_light_sample;
+}
+
+// continues the path with the probability of its largest throughput component
+// and scales the throughput by its inverse, which keeps the estimator unbiased;
+// the decision of bounce sp uses the dimensions after those of all the bounces
+bool Renderer::russian_roulette(float3 &throughput, int sp, int sample_id, int i, int j)
+{
+    if (sp + 1 < m_rr_depth)
+        return true;
+
+    float survival = std::min(std::max(throughput.x, std::max(throughput.y, throughput.z)), RR_MAX_SURVIVAL);
+    if (m_sampler.get_sample(sample_id, i, j, 2 + 4 * m_max_nb_bounces + sp) >= survival)
+        return false;
 
-    return out_color;
+    throughput /= survival;
+    return true;
+}
+
+bool Renderer::occluded(ray &r, float t_max, ShadowCache &shadows, TraversalStats &stats)
+{
+    stats.nb_shadow_rays++;
+
+    if (shadows.occluder)
+    {
+        auto trit = triangle(shadows.occluder).intersect(r);
+        if (trit.first && trit.second <= t_max)
+        {
+            stats.nb_occluder_hits++;
+            return true;
+        }
+    }
+
+    return visibility(r, t_max, stats, &shadows.occluder);
+}
+
+// traces the shadow rays of a tile by depth, the rays leaving the primary hits
+// first, so that consecutive rays are coherent and share their occluders
+void Renderer::trace_shadow_batch(ShadowCache &shadows, float3 *colors, TraversalStats &stats)
+{
+    for (int depth = 0; depth < m_max_nb_bounces; ++depth)
+    {
+        for (auto &s : shadows.batch)
+        {
+            if (s.depth == depth && !occluded(s.r, s.t_max, shadows, stats))
+                colors[s.pixel] += s.contribution;
+        }
+    }
 
+    shadows.batch.clear();
 }
@@ -2,10 +2,53 @@
 #define RENDERER_H
 
 #include <cfloat>
+#include <iostream>
 
 #include "bvh.h"
+#include "wide_bvh.h"
+#include "compressed_bvh.h"
+#include "scene.h"
 #include "camera.h"
 #include "sampler.h"
+#include "wavefront.h"
+#include "tile_scheduler.h"
+#include "render_stats.h"
+#include "image_writer.h"
+
+// bounces always traced before russian roulette may end a path
+#define RR_MIN_DEPTH 3
+// keeps a little variance on the paths that reflect all the light
+#define RR_MAX_SURVIVAL 0.95f
+// bounces of a path at most, each one takes 5 dimensions of the sampler after the 2 of the camera
+#define MAX_PATH_DEPTH ((SAMPLER_MAX_DIMENSIONS - 2) / 5)
+// samples per pixel of each pass of a progressive render
+#define PROGRESSIVE_PASS_SPP 4
+// samples of every pixel before adaptive sampling may stop a block
+#define ADAPTIVE_BASE_SPP 16
+// relative error of a pixel below which it needs no more samples
+#define ADAPTIVE_THRESHOLD 0.05f
+// luminance the error of darker pixels is relative to, so black pixels converge
+#define ADAPTIVE_MIN_LUMINANCE 0.01f
+
+// light sample of a path, traced right away or later with the rest of its tile
+struct ShadowRay
+{
+    ray    r;
+    float  t_max;
+    float3 contribution; // weighted by the path throughput, added if the light is visible
+    int    pixel;        // lane of the pixel in its tile
+    int    depth;
+};
+
+// shadow rays state of a thread, the face that blocked the last shadow ray is
+// tested before the traversal since neighbouring rays tend to hit it as well
+struct alignas(64) ShadowCache
+{
+    ShadowCache() : occluder(false, 0.0f, -1) {}
+
+    Hit                    occluder;
+    std::vector<ShadowRay> batch;
+};
 
 class Renderer
 {
@@ -13,33 +56,258 @@ public:
     Renderer(int height, int width, int spp, int max_nb_bounces, float3 max_sample_value = float3(FLT_MAX))
         : m_height(height), m_width(width), m_spp(spp), m_max_nb_bounces(max_nb_bounces), max_sample_value(max_sample_value)
     {
-        m_sampler = Sampler(m_spp, 2 + 4 * m_max_nb_bounces, m_height, m_width, Sampler::SOBOL);
+        set_sampler(Sampler::OWEN_SOBOL);
         m_image.resize(m_height * m_width, float3(0.0f));
+        m_nb_samples = 0;
+        m_nb_block_rows = (m_height + RAY_PACKET_HEIGHT - 1) / RAY_PACKET_HEIGHT;
+        m_nb_block_cols = (m_width  + RAY_PACKET_WIDTH  - 1) / RAY_PACKET_WIDTH;
         m_verbose = true;
         m_scene_epsilon = 1e-3f;
+        m_use_wide_bvh       = false;
+        m_use_compressed_bvh = false;
+        m_bvh_method         = BVH::SWEEP_SAH;
+        m_bvh_layout         = BVH_NODE_LAYOUT;
+        m_split_budget       = SBVH_SPLIT_BUDGET;
+        m_scene              = nullptr;
+        m_mesh               = nullptr;
+        m_use_packets        = true;
+        m_batch_shadow_rays  = false;
+        m_use_wavefront      = false;
+        m_rr_depth           = RR_MIN_DEPTH;
+        m_tile_size          = TILE_SIZE;
+        m_tile_order         = TileScheduler::HILBERT;
+        m_adaptive_threshold = 0.0f;
+        m_adaptive_base_spp  = ADAPTIVE_BASE_SPP;
     }
 
     inline void set_camera(Camera &camera) { m_camera = &camera; }
-    inline void set_mesh(Mesh &mesh)       { m_mesh = &mesh; m_bvh = BVH(m_mesh); }
+
+    // the table-based methods keep a float per pixel and dimension, OWEN_SOBOL keeps none
+    inline void set_sampler(Sampler::Method method)
+    {
+        // 2 camera dimensions, 4 per bounce, then 1 per bounce for russian roulette
+        m_sampler = Sampler(std::max(m_spp, 1), 2 + 5 * m_max_nb_bounces, m_height, m_width, method);
+    }
+
+    // renders the instances of a built scene instead of a single mesh
+    inline void set_scene(Scene &scene)    { m_scene  = &scene;  }
+    inline void set_mesh(Mesh &mesh)
+    {
+        m_mesh = &mesh;
+        m_bvh  = m_bvh_cache.empty() ? BVH(m_mesh, m_bvh_method, m_split_budget) : BVH(m_mesh, m_bvh_method, m_bvh_cache, m_split_budget);
+        m_bvh.reorder_nodes(m_bvh_layout);
+        if (m_use_wide_bvh)
+            m_wide_bvh = WideBVH(m_bvh, m_mesh);
+
+        // the binary BVH is released so that only the compressed one stays in memory
+        if (m_use_compressed_bvh)
+        {
+            m_compressed_bvh = CompressedBVH(m_bvh, m_mesh);
+            m_bvh = BVH();
+        }
+    }
+
+    // after the mesh vertices moved, refits the BVH instead of building it
+    // again, except for the compressed BVH which has no binary BVH to refit;
+    // returns the number of rebuilt subtrees
+    inline int update_mesh(float rebuild_threshold = BVH_REBUILD_THRESHOLD)
+    {
+        if (m_scene || !m_mesh)
+        {
+            std::cout << "update_mesh needs a mesh set with set_mesh, not a scene" << std::endl;
+            return 0;
+        }
+
+        if (m_use_compressed_bvh)
+        {
+            set_mesh(*m_mesh);
+            return 0;
+        }
+
+        int nb_rebuilt = m_bvh.refit(rebuild_threshold, m_verbose);
+        if (m_use_wide_bvh)
+            m_wide_bvh = WideBVH(m_bvh, m_mesh);
+        return nb_rebuilt;
+    }
+
+    inline void set_verbose(bool verbose) { m_verbose = verbose; }
+
+    // must be set before set_mesh
+    inline void use_wide_bvh(bool use_wide_bvh)            { m_use_wide_bvh = use_wide_bvh; }
+    inline void use_compressed_bvh(bool use_compressed_bvh) { m_use_compressed_bvh = use_compressed_bvh; }
+    inline void set_bvh_method(BVH::BuildMethod bvh_method) { m_bvh_method   = bvh_method;   }
+    inline void set_bvh_layout(BVH::NodeLayout bvh_layout)  { m_bvh_layout   = bvh_layout;   }
+    inline void set_bvh_cache(const std::string &bvh_cache) { m_bvh_cache    = bvh_cache;    }
+    inline void set_split_budget(float split_budget)        { m_split_budget = split_budget; }
+
+    // traces primary rays in packets, only with a single binary BVH
+    inline void use_packets(bool use_packets)               { m_use_packets  = use_packets;  }
+
+    // defers the shadow rays of each packet block of pixels and traces them together once
+    // the samples of the block are done; with adaptive sampling they are traced after each
+    // sample instead, as its error estimate needs the whole value of the sample
+    inline void batch_shadow_rays(bool batch_shadow_rays)   { m_batch_shadow_rays = batch_shadow_rays; }
+
+    // advances all the paths of a tile bounce by bounce in separate stages over queues,
+    // where trace_path follows each path to its end before the next one. The later bounces and the shadow rays go through the binary BVH as streams, the
+    // wide, compressed and scene BVHs still trace them one ray at a time
+    inline void use_wavefront(bool use_wavefront)           { m_use_wavefront = use_wavefront; }
+
+    // bounces traced before russian roulette may end the paths, up to max_nb_bounces
+    inline void set_rr_depth(int rr_depth)                  { m_rr_depth = rr_depth; }
+
+    // tile_size is rounded down to whole packets, the timings of the tiles go to stats_path if set
+    inline void set_tiles(int tile_size, TileScheduler::Order order)
+    {
+        m_tile_size  = std::max(RAY_PACKET_WIDTH, tile_size / RAY_PACKET_WIDTH * RAY_PACKET_WIDTH);
+        m_tile_order = order;
+    }
+    inline void set_tile_stats(const std::string &stats_path) { m_tile_stats_path = stats_path; }
+
+    // stops sampling the packet-sized blocks whose pixels have a relative standard error
+    // below threshold once they have base_spp samples, 0 samples every pixel alike
+    inline void set_adaptive(float threshold, int base_spp = ADAPTIVE_BASE_SPP)
+    {
+        m_adaptive_threshold = threshold;
+        m_adaptive_base_spp  = std::max(base_spp, 2);
+    }
 
     void render();
-    float3 sample_ray(ray r, int sp, int sample_id, int i, int j);
+
+    // renders passes of pass_spp samples per pixel into the accumulation buffer until
+    // target_spp samples or time_budget seconds, 0 for no bound, and hands the image
+    // to writer every write_interval seconds. A pass is not started if it would end
+    // past the budget at the pace of the previous one
+    void render_progressive(int target_spp, double time_budget, int pass_spp = PROGRESSIVE_PASS_SPP,
+                            ImageWriter *writer = nullptr, double write_interval = 0.0);
+    inline int nb_samples(void) const { return m_nb_samples; }
+
+    // samples of each pixel relative to the most sampled ones, from black to white
+    std::vector<float3> sample_heatmap(void) const;
+    inline const RenderStats& stats(void) const { return m_stats; }
+    float3 trace_path(ray r, Hit hit, int sample_id, int i, int j, TraversalStats &stats, ShadowCache &shadows);
+    bool   shade(ray &r, const Hit &hit, int sp, int sample_id, int i, int j, float3 &throughput, float3 &radiance, ShadowRay &light_sample);
     std::vector<float3> &get_image() { return m_image; }
 
 private:
     int m_height, m_width;
     int m_spp, m_max_nb_bounces;
+    int m_rr_depth;
+
+    int                  m_tile_size;
+    TileScheduler::Order m_tile_order;
+    std::string          m_tile_stats_path;
 
     std::vector<float3> m_image;
+    std::vector<float3> m_accumulation; // radiance summed over the samples of each pixel
+    std::vector<float>  m_luminance_sq; // squared luminance of the samples summed alike
+    int                 m_nb_samples;   // passes so far, all the blocks still active have them
+
+    // samples done and adaptive state of each packet-sized block of pixels
+    int                m_nb_block_rows, m_nb_block_cols;
+    std::vector<int>   m_block_samples;
+    std::vector<char>  m_block_active;
+    float              m_adaptive_threshold;
+    int                m_adaptive_base_spp;
 
     BVH     m_bvh;
+    WideBVH m_wide_bvh;
+    CompressedBVH m_compressed_bvh;
     Mesh   *m_mesh;
+    Scene  *m_scene;
     Camera *m_camera;
     Sampler m_sampler;
 
     bool    m_verbose;
+    bool    m_use_wide_bvh;
+    bool    m_use_compressed_bvh;
+    bool    m_use_packets;
+    bool    m_batch_shadow_rays;
+    bool    m_use_wavefront;
+
+    BVH::BuildMethod m_bvh_method;
+    BVH::NodeLayout  m_bvh_layout;
+    std::string      m_bvh_cache;
+    float            m_split_budget;
     float   m_scene_epsilon;
     float3  max_sample_value;
+
+    RenderStats m_stats;
+
+    // samples [first_sample, first_sample + nb_samples) of every pixel, added to m_accumulation
+    void render_pass(TileScheduler &scheduler, int first_sample, int nb_samples);
+    void render_paths(TileScheduler &scheduler, int first_sample, int nb_samples);
+    int  render_block(int bi, int bj, int first_sample, int nb_samples, TraversalStats &stats, ShadowCache &shadows);
+    void render_wavefront(TileScheduler &scheduler, int first_sample, int nb_samples);
+    int  render_wavefront_tile(const Tile &tile, int first_sample, int nb_samples, WavefrontPaths &paths, TraversalStats &stats, ShadowCache &shadows);
+    void resolve_image(void);
+
+    // deactivates the blocks that converged, returns the number of blocks left
+    int  update_adaptive(void);
+
+    inline int  block_index(int i, int j) const { return (i / RAY_PACKET_HEIGHT) * m_nb_block_cols + j / RAY_PACKET_WIDTH; }
+    inline bool block_active(int i, int j) const { return m_block_active[block_index(i, j)]; }
+
+    // stages of the wavefront mode, in wavefront.cpp
+    void wavefront_generate(WavefrontPaths &paths, const Tile &tile, int sample_id);
+    void wavefront_extend(WavefrontPaths &paths, int sp, TraversalStats &stats);
+    void wavefront_hit(WavefrontPaths &paths, int p, const Hit &hit);
+    void wavefront_shade(WavefrontPaths &paths, const Tile &tile, int sample_id, int sp);
+    void wavefront_shadow(WavefrontPaths &paths, ShadowCache &shadows, TraversalStats &stats);
+
+    bool russian_roulette(float3 &throughput, int sp, int sample_id, int i, int j);
+    bool occluded(ray &r, float t_max, ShadowCache &shadows, TraversalStats &stats);
+    void trace_shadow_batch(ShadowCache &shadows, float3 *colors, TraversalStats &stats);
+
+    inline Hit intersect(ray &r, float &t_max, TraversalStats &stats)
+    {
+        if (m_scene)
+            return m_scene->intersect(r, t_max, &stats);
+        if (m_use_compressed_bvh)
+            return m_compressed_bvh.intersect(r, t_max, &stats);
+        return m_use_wide_bvh ? m_wide_bvh.intersect(r, t_max, &stats) : m_bvh.intersect(r, t_max, &stats);
+    }
+
+    // the wavefront stages trace streams through the binary BVH of a single mesh
+    inline bool use_ray_streams(void) const { return !m_scene && !m_use_wide_bvh && !m_use_compressed_bvh; }
+
+    inline void intersect_packet(const RayPacket &packet, float *t_max, Hit *hits, TraversalStats &stats)
+    {
+        if (m_use_packets && !m_scene && !m_use_wide_bvh && !m_use_compressed_bvh)
+            return m_bvh.intersect_packet(packet, t_max, hits, &stats);
+
+        for (int k = 0; k < RAY_PACKET_SIZE; ++k)
+        {
+            if ((packet.active >> k) & 1)
+            {
+                ray r = packet.get(k);
+                hits[k] = intersect(r, t_max[k], stats);
+            }
+        }
+    }
+
+    inline bool visibility(ray &r, float t_max, TraversalStats &stats, Hit *occluder)
+    {
+        if (m_scene)
+            return m_scene->visibility(r, t_max, &stats, occluder);
+        if (m_use_compressed_bvh)
+            return m_compressed_bvh.visibility(r, t_max, &stats, occluder);
+        return m_use_wide_bvh ? m_wide_bvh.visibility(r, t_max, &stats, occluder) : m_bvh.visibility(r, t_max, &stats, occluder);
+    }
+
+    // shading queries on the face of a hit, in the mesh or in the scene
+    inline Material& material(const Hit &hit)          { return m_scene ? m_scene->material(hit)  : m_mesh->face_material(hit.face_id);  }
+    inline float3    normal(const Hit &hit, float3 &p) { return m_scene ? m_scene->normal(hit, p) : m_mesh->face_normal(hit.face_id, p); }
+    inline Triangle  triangle(const Hit &hit)          { return m_scene ? m_scene->triangle(hit)  : m_mesh->triangle(hit.face_id);       }
+
+    inline int nb_emissive_faces(void) { return m_scene ? m_scene->nb_emissive_faces() : m_mesh->nb_emissive_faces(); }
+
+    inline Hit sample_emissive_face(float &r)
+    {
+        if (m_scene)
+            return m_scene->sample_emissive_face(r);
+        return Hit(true, 0.0f, m_mesh->emissive_face_index(m_mesh->sample_emissive_face_id(r)));
+    }
 };
 
 #endif // RENDERER_H
@@ -1,14 +1,37 @@
 #include "sampler.h"
+#include "sobol_tables.h"
 
 #include <cstdlib>
 #include <cmath>
-
 #include <iostream>
-#include <iomanip>
-#include <fstream>
+#include <algorithm>
+
+static_assert(SOBOL_NB_DIMENSIONS >= SAMPLER_MAX_DIMENSIONS, "the Sobol tables miss dimensions");
 
 void Sampler::generate_samples(Method method)
 {
+    // no table at all, the samples come from the direction numbers
+    if (method == OWEN_SOBOL || method == Z_SOBOL)
+    {
+        generate_directions(m_dim);
+
+        m_log2_spp = 0;
+        while ((1 << m_log2_spp) < m_spp)
+            m_log2_spp += 2;
+        m_nb_levels = 0;
+        while ((1 << m_nb_levels) < std::max(m_height, m_width))
+            m_nb_levels++;
+
+        // the Z-order of the pixel and the sample index share the 32 bits of a Sobol index
+        if (method == Z_SOBOL && 2 * m_nb_levels + m_log2_spp > 32)
+        {
+            std::cout << "Z-order Sobol needs " << 2 * m_nb_levels + m_log2_spp
+                      << " index bits for this image and spp, using Owen-scrambled Sobol instead" << std::endl;
+            m_method = OWEN_SOBOL;
+        }
+        return;
+    }
+
     if (method == RANDOM)
     {
         generate_samples_random();
@@ -48,109 +71,26 @@ void Sampler::generate_offsets()
 }
 
 
-using namespace std;
-//from http://web.maths.unsw.edu.au/~fkuo/sobol/
+// Sobol points in Gray-code order, each point differs from the previous one by
+// a single direction number per dimension, the one of the lowest set bit of its index
 void Sampler::generate_samples_sobol()
 {
-
-    int N = m_spp;
     int D = m_dim - 2;
-    ifstream infile("../../data/new-joe-kuo-6.21201", ios::in);
-    if (!infile) {
-        cout << "Input file containing direction numbers cannot be found!\n";
-        exit(1);
-    }
-    char buffer[1000];
-    infile.getline(buffer,1000,'\n');
-
-    // L = max number of bits needed
-    unsigned L = (unsigned)ceil(log((double)N)/log(2.0));
-
-    // C[i] = index from the right of the first zero bit of i
-    unsigned *C = new unsigned [N];
-    C[0] = 1;
-    for (unsigned i=1;i<=N-1;i++) {
-        C[i] = 1;
-        unsigned value = i;
-        while (value & 1) {
-            value >>= 1;
-            C[i]++;
-        }
-    }
-
-    // POINTS[i][j] = the jth component of the ith point
-    //                with i indexed from 0 to N-1 and j indexed from 0 to D-1
-    double **POINTS = new double * [N];
-    for (unsigned i=0;i<=N-1;i++) POINTS[i] = new double [D];
-    for (unsigned j=0;j<=D-1;j++) POINTS[0][j] = 0;
-
-    // ----- Compute the first dimension -----
-
-    // Compute direction numbers V[1] to V[L], scaled by pow(2,32)
-    unsigned *V = new unsigned [L+1];
-    for (unsigned i=1;i<=L;i++) V[i] = 1 << (32-i); // all m's = 1
-
-    // Evalulate X[0] to X[N-1], scaled by pow(2,32)
-    unsigned *X = new unsigned [N];
-    X[0] = 0;
-    for (unsigned i=1;i<=N-1;i++) {
-        X[i] = X[i-1] ^ V[C[i-1]];
-        POINTS[i][0] = (double)X[i]/pow(2.0,32); // *** the actual points
-        //        ^ 0 for first dimension
-    }
-
-    // Clean up
-    delete [] V;
-    delete [] X;
-
+    generate_directions(D);
 
-    // ----- Compute the remaining dimensions -----
-    for (unsigned j=1;j<=D-1;j++) {
-
-        // Read in parameters from file
-        unsigned d, s;
-        unsigned a;
-        infile >> d >> s >> a;
-        unsigned *m = new unsigned [s+1];
-        for (unsigned i=1;i<=s;i++) infile >> m[i];
-
-        // Compute direction numbers V[1] to V[L], scaled by pow(2,32)
-        unsigned *V = new unsigned [L+1];
-        if (L <= s) {
-            for (unsigned i=1;i<=L;i++) V[i] = m[i] << (32-i);
-        }
-        else {
-            for (unsigned i=1;i<=s;i++) V[i] = m[i] << (32-i);
-            for (unsigned i=s+1;i<=L;i++) {
-                V[i] = V[i-s] ^ (V[i-s] >> s);
-                for (unsigned k=1;k<=s-1;k++)
-                    V[i] ^= (((a >> (s-1-k)) & 1) * V[i-k]);
-            }
-        }
-
-        // Evalulate X[0] to X[N-1], scaled by pow(2,32)
-        unsigned *X = new unsigned [N];
-        X[0] = 0;
-        for (unsigned i=1;i<=N-1;i++) {
-            X[i] = X[i-1] ^ V[C[i-1]];
-            POINTS[i][j] = (double)X[i]/pow(2.0,32); // *** the actual points
-            //        ^ j for dimension (j+1)
-        }
-
-        // Clean up
-        delete [] m;
-        delete [] V;
-        delete [] X;
-    }
-    delete [] C;
-
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<> dis(0, 1);
+    std::vector<uint32_t> X(D, 0);
 
     int nb_total_samples = m_spp * m_dim;
     m_samples.resize(nb_total_samples);
     for (int i = 0; i < m_spp; ++i)
+    {
+        if (i > 0)
+        {
+            const uint32_t *V = &m_directions[__builtin_ctz(i)];
+            for (int j = 0; j < D; ++j)
+                X[j] ^= V[j * 32];
+        }
+
         for (int j = 0; j < m_dim; ++j)
         {
             if (j < 2)
@@ -159,9 +99,36 @@ void Sampler::generate_samples_sobol()
             }
             else
             {
-                m_samples[i * m_dim + j] = (float) POINTS[i][j - 2];
+                m_samples[i * m_dim + j] = (float) (X[j - 2] / std::pow(2.0, 32));
             }
         }
+    }
+}
+
+// the 32 direction numbers of the first nb_dims dimensions, enough for any
+// sample index below 2^32
+void Sampler::generate_directions(int nb_dims)
+{
+    m_directions.assign(nb_dims * 32, 0);
 
-    delete [] POINTS;
+    // the first dimension has all m's = 1
+    for (unsigned i = 0; i < 32 && nb_dims > 0; i++)
+        m_directions[i] = 1u << (31 - i);
+
+    for (int j = 1; j < nb_dims; j++)
+    {
+        const SobolPolynomial &p = sobol_polynomials[j - 1];
+        unsigned s = p.s, a = p.a;
+
+        // V[i] is stored at i - 1
+        uint32_t *V = &m_directions[j * 32];
+        for (unsigned i = 1; i <= s; i++)
+            V[i - 1] = p.m[i - 1] << (32 - i);
+        for (unsigned i = s + 1; i <= 32; i++)
+        {
+            V[i - 1] = V[i - s - 1] ^ (V[i - s - 1] >> s);
+            for (unsigned k = 1; k <= s - 1; k++)
+                V[i - 1] ^= (((a >> (s - 1 - k)) & 1) * V[i - k - 1]);
+        }
+    }
 }
@@ -7,19 +7,27 @@
 #include <limits>
 #include <chrono>
 #include <thread>
+#include <cstdint>
 
 #include <omp.h>
 
 #include "math_tools.h"
 
+// dimensions the Sobol methods can sample, those of the tables compiled in
+#define SAMPLER_MAX_DIMENSIONS 1024
+
 class Sampler
 {
 
 public:
-    enum Method {RANDOM, SOBOL};
+    // OWEN_SOBOL computes each sample from the pixel, sample index and dimension,
+    // Z_SOBOL as well but shares one sequence between the pixels so that their
+    // errors spread as blue noise, the others look up tables of spp samples and
+    // per-pixel offsets
+    enum Method {RANDOM, SOBOL, OWEN_SOBOL, Z_SOBOL};
 
     Sampler() {}
-    Sampler(int spp, int dim, int height, int width, Method method) : m_spp(spp), m_dim(dim), m_height(height), m_width(width)
+    Sampler(int spp, int dim, int height, int width, Method method) : m_spp(spp), m_dim(dim), m_height(height), m_width(width), m_method(method)
     {
         generate_samples(method);
     }
@@ -27,6 +35,7 @@ public:
     void generate_samples(Method method);
     void generate_samples_sobol();
     void generate_samples_random();
+    void generate_directions(int nb_dims);
 
 
     void generate_offsets();
@@ -39,17 +48,153 @@ public:
         return distribution(generator);
     }
 
-    inline float get_sample(int n, int i, int j, int d)
+    // sample n of a pixel in dimension d, for any n below 2^32: the table methods go
+    // on past their spp samples with the Sobol points that follow, or hashed random
+    // values, shifted by the offsets of the pixel
+    inline float sample(uint32_t n, uint32_t pixel, uint32_t d) const
+    {
+        if (m_method == OWEN_SOBOL)
+            return owen_sobol(n, pixel, d);
+        if (m_method == Z_SOBOL)
+            return n < (uint32_t) m_spp ? z_sobol(n, pixel, d) : owen_sobol(n, pixel, d);
+
+        float s;
+        if (n < (uint32_t) m_spp)
+            s = m_samples[n * m_dim + d];
+        else if (m_method == SOBOL && d >= 2)
+            s = to_float(sobol(n ^ (n >> 1), d - 2)); // the table is in Gray-code order
+        else
+            s = to_float(hash(hash(n) ^ d));
+
+        return wrap(s + m_offsets[pixel * m_dim + d]);
+    }
+
+    inline float get_sample(int n, int i, int j, int d) const
     {
-        return wrap(m_samples[n * m_dim + d] + m_offsets[(m_width * i + j) * m_dim + d]);
+        return sample(n, m_width * i + j, d);
     }
 
 private:
+    // Sobol point n in dimension d of m_directions, scaled by 2^32
+    inline uint32_t sobol(uint32_t n, uint32_t d) const
+    {
+        const uint32_t *v = &m_directions[d * 32];
+
+        uint32_t x = 0;
+        for (; n; n >>= 1, ++v)
+        {
+            if (n & 1)
+                x ^= *v;
+        }
+        return x;
+    }
+
+    // 24 bits so that the float stays below 1
+    static inline float to_float(uint32_t x) { return (x >> 8) * (1.0f / (1 << 24)); }
+
+    // Sobol point n followed by a nested uniform scramble seeded by the pixel and
+    // the dimension (Burley, Practical Hash-based Owen Scrambling, 2020), which
+    // keeps the stratification of every prefix
+    inline float owen_sobol(uint32_t n, uint32_t pixel, uint32_t d) const
+    {
+        uint32_t x = sobol(n, d);
+
+        x = reverse_bits(x);
+        x = laine_karras_permutation(x, hash(pixel * m_dim + d));
+        x = reverse_bits(x);
+
+        return to_float(x);
+    }
+
+    // Sobol point n of the pixel in a sequence shared by all the pixels, each one
+    // takes a block of the next power of four above spp points and the blocks follow
+    // the pixels in Z-order, so that neighbouring pixels have complementary samples
+    // and their errors cancel out as blue noise (Ahmed and Wonka, Screen-Space
+    // Blue-Noise Diffusion of Monte Carlo Sampling Error via Hierarchical Ordering
+    // of Pixels, 2020). Each base 4 digit of the index, those of the sample too, is
+    // permuted by a hash of the digits above it, which hides the structure of the
+    // curve. Each pair of dimensions takes the first two Sobol dimensions, whose
+    // points are the best stratified, with its own permutations so that the pairs
+    // stay independent
+    inline float z_sobol(uint32_t n, uint32_t pixel, uint32_t d) const
+    {
+        // the 24 orders of 4 quadrants, 2 bits per quadrant
+        static const uint8_t permutations[24] = {0xe4, 0xb4, 0xd8, 0x78, 0x9c, 0x6c, 0xe1, 0xb1, 0xc9, 0x39, 0x8d, 0x2d,
+                                                 0xd2, 0x72, 0xc6, 0x36, 0x4e, 0x1e, 0x93, 0x63, 0x87, 0x27, 0x4b, 0x1b};
+
+        uint32_t morton = expand_bits(pixel / m_width) << 1 | expand_bits(pixel % m_width);
+        uint32_t index  = morton << m_log2_spp | n;
+
+        uint32_t rank = 0;
+        for (int level = m_nb_levels + m_log2_spp / 2 - 1; level >= 0; --level)
+        {
+            uint32_t digit  = (index >> (2 * level)) & 3;
+            uint32_t parent = level < 15 ? index >> (2 * level + 2) : 0;
+            uint8_t  order  = permutations[hash(parent ^ hash(level ^ ((d / 2) << 8))) % 24];
+
+            rank |= ((order >> (2 * digit)) & 3) << (2 * level);
+        }
+
+        uint32_t x = sobol(rank, d % 2);
+
+        // the same scramble for every pixel keeps the blocks complementary
+        x = reverse_bits(x);
+        x = laine_karras_permutation(x, hash(d));
+        x = reverse_bits(x);
+
+        return to_float(x);
+    }
+
+    // spreads the 16 low bits of x to the even bits
+    static inline uint32_t expand_bits(uint32_t x)
+    {
+        x &= 0xffff;
+        x = (x | x << 8) & 0x00ff00ff;
+        x = (x | x << 4) & 0x0f0f0f0f;
+        x = (x | x << 2) & 0x33333333;
+        x = (x | x << 1) & 0x55555555;
+        return x;
+    }
+
+    static inline uint32_t reverse_bits(uint32_t x)
+    {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+        x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+        x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+        x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+        return x;
+    }
+
+    // each bit is flipped by a hash of the bits below it, the reverse of an Owen scramble
+    static inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+    {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+
+    static inline uint32_t hash(uint32_t x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
     int m_spp, m_dim;
     int m_height, m_width;
+    Method m_method;
     std::vector<float> m_pixel_samples;
     std::vector<float> m_samples;
     std::vector<float> m_offsets;
+    std::vector<uint32_t> m_directions; // 32 per dimension, scaled by 2^32
+    int m_log2_spp, m_nb_levels;        // bits of the sample, even, and Z-order levels of the pixel in a Z_SOBOL index
 };
 
 #endif // SAMPLER_H
@@ -0,0 +1,402 @@
+#include <algorithm>
+#include <iostream>
+
+#include "bvh.h"
+
+// spatial split BVH, Stich et al. 2009 "Spatial Splits in Bounding Volume Hierarchies"
+
+static const AABB empty_aabb(float3(1e32f), float3(-1e32f));
+
+static inline bool is_empty(const AABB &bb)
+{
+    return bb.mini.x > bb.maxi.x || bb.mini.y > bb.maxi.y || bb.mini.z > bb.maxi.z;
+}
+
+static inline float surface(const AABB &bb)
+{
+    return is_empty(bb) ? 0.0f : bb.surface();
+}
+
+static inline AABB intersection(const AABB &a, const AABB &b)
+{
+    return AABB(max(a.mini, b.mini), min(a.maxi, b.maxi));
+}
+
+static inline float3 center(const AABB &bb)
+{
+    return (bb.mini + bb.maxi) * 0.5f;
+}
+
+// bounds of the part of t lying between lo and hi along axis
+static AABB clip_triangle(const Triangle &t, int axis, float lo, float hi)
+{
+    AABB bb = empty_aabb;
+    const float3 *v[3] = {&t.v0, &t.v1, &t.v2};
+    const float planes[2] = {lo, hi};
+
+    for (int i = 0; i < 3; ++i)
+    {
+        const float3 &a = *v[i];
+        const float3 &b = *v[(i + 1) % 3];
+        float da = a.data[axis];
+        float db = b.data[axis];
+
+        if (da >= lo && da <= hi)
+            bb.extend(AABB(a, a));
+
+        for (int k = 0; k < 2; ++k)
+        {
+            float p = planes[k];
+            if ((da < p && db > p) || (da > p && db < p))
+            {
+                float3 q = a + (b - a) * ((p - da) / (db - da));
+                q.data[axis] = p;
+                bb.extend(AABB(q, q));
+            }
+        }
+    }
+    return bb;
+}
+
+void BVH::build_sbvh(void)
+{
+    int nb_faces = m_mesh->nb_faces();
+
+    std::vector<Reference> refs(nb_faces);
+    AABB root_bb = empty_aabb;
+    for (int i = 0; i < nb_faces; ++i)
+    {
+        refs[i] = Reference(i, m_mesh->triangle(i).bb());
+        root_bb.extend(refs[i].bb);
+    }
+
+    m_max_references = (int) (nb_faces * (1.0f + m_split_budget));
+    m_root_surface   = surface(root_bb);
+    m_nb_indices     = nb_faces;
+
+    m_indices.clear();
+    m_indices.reserve(m_max_references);
+
+    // slot 1 is left empty so that every sibling pair starts at an even index
+    m_nodes.clear();
+    m_nodes.push_back(Node(root_bb, 0, 0));
+    m_nodes.push_back(Node(AABB(float3(0.0f), float3(0.0f)), 0, 0));
+
+    build_sbvh_node(0, refs, 0);
+
+    m_nb_nodes   = m_nodes.size();
+    m_nb_indices = m_indices.size();
+
+    std::cout << "SBVH | " << m_nb_indices << " references for " << nb_faces << " faces (+"
+              << 100.0f * (m_nb_indices - nb_faces) / std::max(nb_faces, 1) << "%)" << std::endl;
+}
+
+void BVH::build_sbvh_node(int current_node, std::vector<Reference> &refs, int depth)
+{
+    int nb_refs = refs.size();
+
+    if (nb_refs <= MAX_FACES_PER_LEAF)
+    {
+        m_nodes[current_node].offset = m_indices.size();
+        m_nodes[current_node].count  = nb_refs;
+        for (auto &ref : refs)
+            m_indices.push_back(ref.face);
+        return;
+    }
+
+    AABB node_bb = m_nodes[current_node].aabb;
+
+    std::vector<Reference> left, right;
+
+    if (depth < MAX_SAH_DEPTH)
+    {
+        int   object_axis, spatial_axis;
+        float object_position, spatial_position;
+        AABB  object_left_bb, object_right_bb;
+
+        float object_cost  = object_split(refs, object_axis, object_position, object_left_bb, object_right_bb);
+        float spatial_cost = 1e32f;
+
+        // spatial splits are only worth trying where the object split children overlap
+        AABB overlap = intersection(object_left_bb, object_right_bb);
+        if (m_nb_indices < m_max_references && !is_empty(overlap) && surface(overlap) > SBVH_OVERLAP_THRESHOLD * m_root_surface)
+            spatial_cost = spatial_split(refs, node_bb, spatial_axis, spatial_position);
+
+        if (spatial_cost < object_cost)
+        {
+            split_references(refs, spatial_axis, spatial_position, left, right);
+        }
+        else if (object_axis >= 0)
+        {
+            for (auto &ref : refs)
+            {
+                if (center(ref.bb).data[object_axis] < object_position)
+                    left.push_back(ref);
+                else
+                    right.push_back(ref);
+            }
+        }
+    }
+
+    // depth limit, degenerate centroids or a split that failed to separate anything
+    if (left.empty() || right.empty())
+    {
+        left.clear();
+        right.clear();
+
+        AABB centroid_bb = empty_aabb;
+        for (auto &ref : refs)
+        {
+            float3 c = center(ref.bb);
+            centroid_bb.extend(AABB(c, c));
+        }
+        float3 extent = centroid_bb.maxi - centroid_bb.mini;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+        std::nth_element(refs.begin(), refs.begin() + nb_refs / 2, refs.end(), [axis](const Reference &a, const Reference &b) {
+            return center(a.bb).data[axis] < center(b.bb).data[axis];
+        });
+
+        left.assign(refs.begin(), refs.begin() + nb_refs / 2);
+        right.assign(refs.begin() + nb_refs / 2, refs.end());
+    }
+
+    std::vector<Reference>().swap(refs);
+
+    AABB left_bb  = empty_aabb;
+    AABB right_bb = empty_aabb;
+    for (auto &ref : left)
+        left_bb.extend(ref.bb);
+    for (auto &ref : right)
+        right_bb.extend(ref.bb);
+
+    int left_index = m_nodes.size();
+    m_nodes.push_back(Node(intersection(left_bb,  node_bb), -1, 0));
+    m_nodes.push_back(Node(intersection(right_bb, node_bb), -1, 0));
+
+    m_nodes[current_node].offset = left_index;
+    m_nodes[current_node].count  = 0;
+
+    build_sbvh_node(left_index,     left,  depth + 1);
+    build_sbvh_node(left_index + 1, right, depth + 1);
+}
+
+float BVH::object_split(std::vector<Reference> &refs, int &best_axis, float &best_position, AABB &best_left_bb, AABB &best_right_bb)
+{
+    AABB centroid_bb = empty_aabb;
+    for (auto &ref : refs)
+    {
+        float3 c = center(ref.bb);
+        centroid_bb.extend(AABB(c, c));
+    }
+    float3 extent = centroid_bb.maxi - centroid_bb.mini;
+
+    float best_cost = 1e32f;
+    best_axis       = -1;
+    best_left_bb    = empty_aabb;
+    best_right_bb   = empty_aabb;
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (extent.data[axis] <= 0.0f)
+            continue;
+
+        float scale = NB_SAH_BINS / extent.data[axis];
+
+        AABB bins[NB_SAH_BINS];
+        int  counts[NB_SAH_BINS];
+        for (int b = 0; b < NB_SAH_BINS; ++b)
+        {
+            bins[b]   = empty_aabb;
+            counts[b] = 0;
+        }
+
+        for (auto &ref : refs)
+        {
+            int b = std::min((int) ((center(ref.bb).data[axis] - centroid_bb.mini.data[axis]) * scale), NB_SAH_BINS - 1);
+            bins[b].extend(ref.bb);
+            counts[b]++;
+        }
+
+        AABB right_aabbs[NB_SAH_BINS];
+        int  right_counts[NB_SAH_BINS];
+        AABB right_aabb  = empty_aabb;
+        int  right_count = 0;
+        for (int b = NB_SAH_BINS - 1; b > 0; --b)
+        {
+            right_aabb.extend(bins[b]);
+            right_count += counts[b];
+            right_aabbs[b]  = right_aabb;
+            right_counts[b] = right_count;
+        }
+
+        AABB left_aabb  = empty_aabb;
+        int  left_count = 0;
+        for (int b = 1; b < NB_SAH_BINS; ++b)
+        {
+            left_aabb.extend(bins[b - 1]);
+            left_count += counts[b - 1];
+
+            if (left_count == 0 || right_counts[b] == 0)
+                continue;
+
+            float current_cost = surface(left_aabb) * left_count + surface(right_aabbs[b]) * right_counts[b];
+            if (current_cost < best_cost)
+            {
+                best_cost     = current_cost;
+                best_axis     = axis;
+                best_position = centroid_bb.mini.data[axis] + b / scale;
+                best_left_bb  = left_aabb;
+                best_right_bb = right_aabbs[b];
+            }
+        }
+    }
+
+    return best_cost;
+}
+
+float BVH::spatial_split(std::vector<Reference> &refs, const AABB &node_bb, int &best_axis, float &best_position)
+{
+    float best_cost = 1e32f;
+    best_axis       = -1;
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float origin = node_bb.mini.data[axis];
+        float width  = (node_bb.maxi.data[axis] - origin) / NB_SPATIAL_BINS;
+        if (width <= 0.0f)
+            continue;
+
+        AABB bins[NB_SPATIAL_BINS];
+        int  entries[NB_SPATIAL_BINS];
+        int  exits[NB_SPATIAL_BINS];
+        for (int b = 0; b < NB_SPATIAL_BINS; ++b)
+        {
+            bins[b]    = empty_aabb;
+            entries[b] = 0;
+            exits[b]   = 0;
+        }
+
+        // each reference is chopped into the bins it spans
+        for (auto &ref : refs)
+        {
+            int first = std::max(0, std::min((int) ((ref.bb.mini.data[axis] - origin) / width), NB_SPATIAL_BINS - 1));
+            int last  = std::max(0, std::min((int) ((ref.bb.maxi.data[axis] - origin) / width), NB_SPATIAL_BINS - 1));
+
+            const Triangle &t = m_mesh->triangle(ref.face);
+            for (int b = first; b <= last; ++b)
+            {
+                float lo = b == first ? ref.bb.mini.data[axis] : origin + b * width;
+                float hi = b == last  ? ref.bb.maxi.data[axis] : origin + (b + 1) * width;
+                AABB  clipped = intersection(clip_triangle(t, axis, lo, hi), ref.bb);
+                if (!is_empty(clipped))
+                    bins[b].extend(clipped);
+            }
+            entries[first]++;
+            exits[last]++;
+        }
+
+        float right_surfaces[NB_SPATIAL_BINS];
+        int   right_counts[NB_SPATIAL_BINS];
+        AABB  right_aabb  = empty_aabb;
+        int   right_count = 0;
+        for (int b = NB_SPATIAL_BINS - 1; b > 0; --b)
+        {
+            right_aabb.extend(bins[b]);
+            right_count += exits[b];
+            right_surfaces[b] = right_count > 0 ? surface(right_aabb) : 0.0f;
+            right_counts[b]   = right_count;
+        }
+
+        AABB left_aabb  = empty_aabb;
+        int  left_count = 0;
+        for (int b = 1; b < NB_SPATIAL_BINS; ++b)
+        {
+            left_aabb.extend(bins[b - 1]);
+            left_count += entries[b - 1];
+
+            if (left_count == 0 || right_counts[b] == 0)
+                continue;
+
+            float current_cost = surface(left_aabb) * left_count + right_surfaces[b] * right_counts[b];
+            if (current_cost < best_cost)
+            {
+                best_cost     = current_cost;
+                best_axis     = axis;
+                best_position = origin + b * width;
+            }
+        }
+    }
+
+    return best_cost;
+}
+
+void BVH::split_references(std::vector<Reference> &refs, int axis, float position, std::vector<Reference> &left, std::vector<Reference> &right)
+{
+    AABB left_bb  = empty_aabb;
+    AABB right_bb = empty_aabb;
+
+    std::vector<Reference> straddling;
+    for (auto &ref : refs)
+    {
+        if (ref.bb.maxi.data[axis] <= position)
+        {
+            left.push_back(ref);
+            left_bb.extend(ref.bb);
+        }
+        else if (ref.bb.mini.data[axis] >= position)
+        {
+            right.push_back(ref);
+            right_bb.extend(ref.bb);
+        }
+        else
+        {
+            straddling.push_back(ref);
+        }
+    }
+
+    int nb_left  = left.size()  + straddling.size();
+    int nb_right = right.size() + straddling.size();
+
+    // reference unsplitting: a straddling reference goes to a single side when
+    // duplicating it would cost more, or when the budget is spent
+    for (auto &ref : straddling)
+    {
+        const Triangle &t = m_mesh->triangle(ref.face);
+        AABB l_bb = intersection(clip_triangle(t, axis, ref.bb.mini.data[axis], position), ref.bb);
+        AABB r_bb = intersection(clip_triangle(t, axis, position, ref.bb.maxi.data[axis]), ref.bb);
+
+        AABB split_left  = left_bb;  split_left.extend(l_bb);
+        AABB split_right = right_bb; split_right.extend(r_bb);
+        AABB whole_left  = left_bb;  whole_left.extend(ref.bb);
+        AABB whole_right = right_bb; whole_right.extend(ref.bb);
+
+        float split_cost = surface(split_left) * nb_left       + surface(split_right) * nb_right;
+        float left_cost  = surface(whole_left) * nb_left       + surface(right_bb)    * (nb_right - 1);
+        float right_cost = surface(left_bb)    * (nb_left - 1) + surface(whole_right) * nb_right;
+
+        if (m_nb_indices >= m_max_references || is_empty(l_bb) || is_empty(r_bb))
+            split_cost = 1e32f;
+
+        if (split_cost <= left_cost && split_cost <= right_cost)
+        {
+            left.push_back(Reference(ref.face, l_bb));
+            right.push_back(Reference(ref.face, r_bb));
+            left_bb  = split_left;
+            right_bb = split_right;
+            m_nb_indices++;
+        }
+        else if (left_cost <= right_cost)
+        {
+            left.push_back(ref);
+            left_bb = whole_left;
+            nb_right--;
+        }
+        else
+        {
+            right.push_back(ref);
+            right_bb = whole_right;
+            nb_left--;
+        }
+    }
+}
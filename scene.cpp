@@ -0,0 +1,358 @@
+#include <iostream>
+#include <numeric>
+
+#include "scene.h"
+#include "time_tools.h"
+
+Instance::Instance(int mesh_id, const mat3f &linear, const float3 &translation)
+    : mesh_id(mesh_id), linear(linear), inv_linear(inverse(linear)), normal_linear(transpose(inv_linear)), translation(translation)
+{
+}
+
+int Scene::add_mesh(Mesh &mesh)
+{
+    int mesh_id = m_meshes.size();
+    m_meshes.push_back(&mesh);
+
+    if (m_bvh_cache.empty())
+    {
+        m_bvhs.push_back(std::unique_ptr<BVH>(new BVH(&mesh, m_bvh_method, m_split_budget)));
+    }
+    else
+    {
+        std::string cache_path = mesh_id == 0 ? m_bvh_cache : m_bvh_cache + "." + std::to_string(mesh_id);
+        m_bvhs.push_back(std::unique_ptr<BVH>(new BVH(&mesh, m_bvh_method, cache_path, m_split_budget)));
+    }
+    m_bvhs.back()->reorder_nodes(m_bvh_layout);
+
+    if (m_use_wide_bvh)
+        m_wide_bvhs.push_back(std::unique_ptr<WideBVH>(new WideBVH(*m_bvhs.back(), &mesh)));
+    return mesh_id;
+}
+
+int Scene::add_instance(int mesh_id, const mat3f &linear, const float3 &translation)
+{
+    m_instances.push_back(Instance(mesh_id, linear, translation));
+    return m_instances.size() - 1;
+}
+
+void Scene::build(void)
+{
+    Timer timer;
+
+    long long nb_faces = 0;
+    m_emissive_faces.clear();
+
+    for (int i = 0; i < nb_instances(); ++i)
+    {
+        Instance &instance = m_instances[i];
+        Mesh     *mesh     = m_meshes[instance.mesh_id];
+        AABB      mesh_bb  = m_bvhs[instance.mesh_id]->node(0).aabb;
+
+        instance.bb = AABB(float3(1e32f), float3(-1e32f));
+        for (int c = 0; c < 8; ++c)
+        {
+            float3 corner((c & 1) ? mesh_bb.maxi.x : mesh_bb.mini.x,
+                          (c & 2) ? mesh_bb.maxi.y : mesh_bb.mini.y,
+                          (c & 4) ? mesh_bb.maxi.z : mesh_bb.mini.z);
+            corner = instance.to_world(corner);
+            instance.bb.extend(AABB(corner, corner));
+        }
+
+        for (int e = 0; e < mesh->nb_emissive_faces(); ++e)
+            m_emissive_faces.push_back(std::make_pair(mesh->emissive_face_index(e), i));
+
+        nb_faces += mesh->nb_faces();
+    }
+
+    m_instance_indices.resize(nb_instances());
+    std::iota(m_instance_indices.begin(), m_instance_indices.end(), 0);
+
+    // slot 1 is left empty so that every sibling pair starts at an even index
+    m_nodes.clear();
+    m_nodes.push_back(Node(AABB(float3(1e32f), float3(-1e32f)), 0, nb_instances()));
+    m_nodes.push_back(Node(AABB(float3(0.0f), float3(0.0f)), 0, 0));
+    for (auto &instance : m_instances)
+        m_nodes[0].aabb.extend(instance.bb);
+
+    if (nb_instances() > 0)
+        build_node(0, 0, nb_instances(), 0);
+
+    std::cout << "scene | " << nb_meshes() << " meshes | " << nb_instances() << " instances of " << nb_faces << " faces | "
+              << m_nodes.size() << " top-level nodes built in " << timer.elapsed() * 1e-6 << "s" << std::endl;
+}
+
+void Scene::build_node(int current_node, int start_index, int end_index, int depth)
+{
+    int nb = end_index - start_index;
+    if (nb <= TLAS_MAX_INSTANCES_PER_LEAF)
+    {
+        m_nodes[current_node].offset = start_index;
+        m_nodes[current_node].count  = nb;
+        return;
+    }
+
+    auto center = [&](int i) { return (m_instances[i].bb.mini + m_instances[i].bb.maxi) * 0.5f; };
+
+    AABB centroid_bb(float3(1e32f), float3(-1e32f));
+    for (int ii = start_index; ii < end_index; ++ii)
+    {
+        float3 c = center(m_instance_indices[ii]);
+        centroid_bb.extend(AABB(c, c));
+    }
+    float3 extent = centroid_bb.maxi - centroid_bb.mini;
+
+    // binned SAH over the instance bounds, as BVH::binned_split
+    float best_cost = 1e32f;
+    int   best_axis = -1;
+    int   best_bin  = -1;
+
+    for (int axis = 0; axis < 3 && depth < MAX_SAH_DEPTH; ++axis)
+    {
+        if (extent.data[axis] <= 0.0f)
+            continue;
+
+        float scale = NB_SAH_BINS / extent.data[axis];
+
+        AABB bins[NB_SAH_BINS];
+        int  counts[NB_SAH_BINS];
+        for (int b = 0; b < NB_SAH_BINS; ++b)
+        {
+            bins[b]   = AABB(float3(1e32f), float3(-1e32f));
+            counts[b] = 0;
+        }
+
+        for (int ii = start_index; ii < end_index; ++ii)
+        {
+            int i = m_instance_indices[ii];
+            int b = std::min((int) ((center(i).data[axis] - centroid_bb.mini.data[axis]) * scale), NB_SAH_BINS - 1);
+            bins[b].extend(m_instances[i].bb);
+            counts[b]++;
+        }
+
+        float right_surfaces[NB_SAH_BINS];
+        int   right_counts[NB_SAH_BINS];
+        AABB  right_aabb(float3(1e32f), float3(-1e32f));
+        int   right_count = 0;
+        for (int b = NB_SAH_BINS - 1; b > 0; --b)
+        {
+            right_aabb.extend(bins[b]);
+            right_count += counts[b];
+            right_surfaces[b] = right_count > 0 ? right_aabb.surface() : 0.0f;
+            right_counts[b]   = right_count;
+        }
+
+        AABB left_aabb(float3(1e32f), float3(-1e32f));
+        int  left_count = 0;
+        for (int b = 1; b < NB_SAH_BINS; ++b)
+        {
+            left_aabb.extend(bins[b - 1]);
+            left_count += counts[b - 1];
+
+            if (left_count == 0 || right_counts[b] == 0)
+                continue;
+
+            float current_cost = left_aabb.surface() * left_count + right_surfaces[b] * right_counts[b];
+            if (current_cost < best_cost)
+            {
+                best_cost = current_cost;
+                best_axis = axis;
+                best_bin  = b;
+            }
+        }
+    }
+
+    int split_index;
+    if (best_axis >= 0)
+    {
+        float scale = NB_SAH_BINS / extent.data[best_axis];
+        auto middle = std::partition(m_instance_indices.begin() + start_index, m_instance_indices.begin() + end_index, [&](int i) {
+            int b = std::min((int) ((center(i).data[best_axis] - centroid_bb.mini.data[best_axis]) * scale), NB_SAH_BINS - 1);
+            return b < best_bin;
+        });
+        split_index = middle - m_instance_indices.begin();
+    }
+    else
+    {
+        // depth limit or identical centroids
+        int axis    = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        split_index = (start_index + end_index) / 2;
+        std::nth_element(m_instance_indices.begin() + start_index, m_instance_indices.begin() + split_index, m_instance_indices.begin() + end_index, [&](int a, int b) {
+            return center(a).data[axis] < center(b).data[axis];
+        });
+    }
+
+    AABB left_bb(float3(1e32f), float3(-1e32f));
+    AABB right_bb(float3(1e32f), float3(-1e32f));
+    for (int ii = start_index; ii < split_index; ++ii)
+        left_bb.extend(m_instances[m_instance_indices[ii]].bb);
+    for (int ii = split_index; ii < end_index; ++ii)
+        right_bb.extend(m_instances[m_instance_indices[ii]].bb);
+
+    int left_index = m_nodes.size();
+    m_nodes.push_back(Node(left_bb,  -1, 0));
+    m_nodes.push_back(Node(right_bb, -1, 0));
+
+    m_nodes[current_node].offset = left_index;
+    m_nodes[current_node].count  = 0;
+
+    build_node(left_index,     start_index, split_index, depth + 1);
+    build_node(left_index + 1, split_index, end_index,   depth + 1);
+}
+
+Hit Scene::intersect_instance(int instance_id, ray &r, float &t_max, TraversalStats *stats)
+{
+    const Instance &instance = m_instances[instance_id];
+    ray object_ray(instance.to_object(r.origin), instance.inv_linear.dot(r.direction));
+
+    Hit hit = m_use_wide_bvh ? m_wide_bvhs[instance.mesh_id]->intersect(object_ray, t_max, stats)
+                             : m_bvhs[instance.mesh_id]->intersect(object_ray, t_max, stats);
+    hit.instance_id = instance_id;
+    return hit;
+}
+
+bool Scene::visibility_instance(int instance_id, ray &r, float t_max, TraversalStats *stats, Hit *occluder)
+{
+    const Instance &instance = m_instances[instance_id];
+    ray object_ray(instance.to_object(r.origin), instance.inv_linear.dot(r.direction));
+
+    bool occluded = m_use_wide_bvh ? m_wide_bvhs[instance.mesh_id]->visibility(object_ray, t_max, stats, occluder)
+                                   : m_bvhs[instance.mesh_id]->visibility(object_ray, t_max, stats, occluder);
+    if (occluded && occluder)
+        occluder->instance_id = instance_id;
+    return occluded;
+}
+
+Hit Scene::intersect(ray &r, float &t_max, TraversalStats *stats)
+{
+    Hit best_hit = Hit(false, 1e32f, -1);
+
+    // the bottom-level traversals count the ray again for each instance
+    if (stats)
+        stats->nb_rays++;
+    long long nb_rays = stats ? stats->nb_rays : 0;
+
+    auto root_hit = m_nodes[0].aabb.intersect(r);
+    if (!root_hit.first || nb_instances() == 0)
+        return best_hit;
+
+    std::pair<int, float> nodes_stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    nodes_stack[stack_size++] = std::make_pair(0, root_hit.second);
+
+    while (stack_size > 0)
+    {
+        auto c_pair = nodes_stack[--stack_size];
+
+        if (c_pair.second >= t_max)
+            continue;
+
+        const Node &c_node = m_nodes[c_pair.first];
+
+        if (stats)
+            stats->nb_nodes++;
+
+        if (c_node.is_leaf())
+        {
+            for (int ii = c_node.offset; ii < c_node.offset + c_node.count; ++ii)
+            {
+                Hit hit = intersect_instance(m_instance_indices[ii], r, t_max, stats);
+                if (hit.did_hit)
+                    best_hit = hit;
+            }
+            continue;
+        }
+
+        int  first = c_node.offset;
+        int second = c_node.offset + 1;
+
+        auto  first_hit = m_nodes[ first].aabb.intersect(r);
+        auto second_hit = m_nodes[second].aabb.intersect(r);
+
+        if (first_hit.first && second_hit.first && first_hit.second > second_hit.second)
+        {
+            std::swap(first,     second);
+            std::swap(first_hit, second_hit);
+        }
+
+        if (second_hit.second < t_max)
+            nodes_stack[stack_size++] = std::make_pair(second, second_hit.second);
+
+        if (first_hit.second < t_max)
+            nodes_stack[stack_size++] = std::make_pair(first, first_hit.second);
+    }
+
+    if (stats)
+        stats->nb_rays = nb_rays;
+
+    return best_hit;
+}
+
+bool Scene::visibility(ray &r, float t_max, TraversalStats *stats, Hit *occluder)
+{
+    if (stats)
+        stats->nb_rays++;
+    long long nb_rays  = stats ? stats->nb_rays : 0;
+    bool      occluded = false;
+
+    auto root_hit = m_nodes[0].aabb.intersect(r);
+    if (!root_hit.first || nb_instances() == 0)
+        return false;
+
+    int nodes_stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    nodes_stack[stack_size++] = 0;
+
+    while (stack_size > 0 && !occluded)
+    {
+        const Node &c_node = m_nodes[nodes_stack[--stack_size]];
+
+        if (stats)
+            stats->nb_nodes++;
+
+        if (c_node.is_leaf())
+        {
+            for (int ii = c_node.offset; ii < c_node.offset + c_node.count && !occluded; ++ii)
+                occluded = visibility_instance(m_instance_indices[ii], r, t_max, stats, occluder);
+            continue;
+        }
+
+        for (int k = 0; k < 2; ++k)
+        {
+            auto child_hit = m_nodes[c_node.offset + k].aabb.intersect(r);
+            if (child_hit.first && child_hit.second <= t_max)
+                nodes_stack[stack_size++] = c_node.offset + k;
+        }
+    }
+
+    if (stats)
+        stats->nb_rays = nb_rays;
+
+    return occluded;
+}
+
+float3 Scene::normal(const Hit &hit, float3 &p)
+{
+    const Instance &instance = m_instances[hit.instance_id];
+    float3 object_p = instance.to_object(p);
+    float3 n        = m_meshes[instance.mesh_id]->face_normal(hit.face_id, object_p);
+    return instance.normal_linear.dot(n).normalized();
+}
+
+Triangle Scene::triangle(const Hit &hit)
+{
+    const Instance &instance = m_instances[hit.instance_id];
+    const Triangle &t        = m_meshes[instance.mesh_id]->triangle(hit.face_id);
+    return Triangle(instance.to_world(t.v0), instance.to_world(t.v1), instance.to_world(t.v2));
+}
+
+Hit Scene::sample_emissive_face(float &r)
+{
+    int nb_ef = nb_emissive_faces();
+    int e_id  = std::min((int) floor(nb_ef * r), nb_ef - 1);
+
+    r *= nb_ef;
+    r -= e_id;
+
+    return Hit(true, 0.0f, m_emissive_faces[e_id].first, m_emissive_faces[e_id].second);
+}
@@ -0,0 +1,107 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#define TLAS_MAX_INSTANCES_PER_LEAF 1
+
+#include <vector>
+#include <memory>
+#include <string>
+
+#include "math_tools.h"
+#include "memory_tools.h"
+#include "geometry.h"
+#include "mesh.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+
+// affine object to world transform of a shared mesh
+struct Instance
+{
+    Instance() {}
+    Instance(int mesh_id, const mat3f &linear, const float3 &translation);
+
+    int    mesh_id;
+    mat3f  linear;        // object to world
+    mat3f  inv_linear;    // world to object
+    mat3f  normal_linear; // object to world for normals, transpose(inv_linear)
+    float3 translation;
+    AABB   bb;            // world space bounds, set by Scene::build
+
+    inline float3 to_world(const float3 &p)  const { return linear.dot(p) + translation;     }
+    inline float3 to_object(const float3 &p) const { return inv_linear.dot(p - translation); }
+};
+
+// Two-level acceleration structure: a top-level BVH over instances, each of
+// them pointing to the bottom-level BVH of a mesh shared by all its instances.
+// Rays are transformed to object space without being normalized again, so
+// hit distances are the same in both spaces.
+class Scene
+{
+    // same layout as BVH::Node, leaves reference m_instance_indices
+    struct alignas(32) Node
+    {
+        Node() {}
+        Node(AABB aabb, int offset, int count) : aabb(aabb), offset(offset), count(count) {}
+        AABB aabb;
+        int  offset;
+        int  count;
+
+        inline bool is_leaf(void) const { return count > 0; }
+    };
+
+public:
+    Scene() : m_use_wide_bvh(false), m_bvh_method(BVH::SWEEP_SAH), m_bvh_layout(BVH_NODE_LAYOUT), m_split_budget(SBVH_SPLIT_BUDGET) {}
+
+    // must be set before add_mesh
+    inline void use_wide_bvh(bool use_wide_bvh)            { m_use_wide_bvh = use_wide_bvh; }
+    inline void set_bvh_method(BVH::BuildMethod bvh_method) { m_bvh_method   = bvh_method;   }
+    inline void set_bvh_layout(BVH::NodeLayout bvh_layout)  { m_bvh_layout   = bvh_layout;   }
+    inline void set_split_budget(float split_budget)        { m_split_budget = split_budget; }
+
+    // the BVH of mesh k is cached in bvh_cache, with .k appended for k > 0
+    inline void set_bvh_cache(const std::string &bvh_cache) { m_bvh_cache    = bvh_cache;    }
+
+    // builds the bottom-level BVH of the mesh, which must outlive the scene
+    int  add_mesh(Mesh &mesh);
+    int  add_instance(int mesh_id, const mat3f &linear, const float3 &translation);
+
+    // builds the top-level BVH, after all the instances are added
+    void build(void);
+
+    Hit  intersect(ray &r, float &t_max, TraversalStats *stats = nullptr);
+    bool visibility(ray &r, float t_max, TraversalStats *stats = nullptr, Hit *occluder = nullptr);
+
+    // shading queries on the face of a hit, in world space
+    inline Material& material(const Hit &hit) { return m_meshes[m_instances[hit.instance_id].mesh_id]->face_material(hit.face_id); }
+    float3   normal(const Hit &hit, float3 &p);
+    Triangle triangle(const Hit &hit);
+
+    // uniform over the emissive faces of all the instances, r is rescaled to [0, 1)
+    Hit sample_emissive_face(float &r);
+    inline int nb_emissive_faces(void) const { return m_emissive_faces.size(); }
+
+    inline int nb_meshes(void)    const { return m_meshes.size();    }
+    inline int nb_instances(void) const { return m_instances.size(); }
+
+private:
+    std::vector<Mesh*>                                m_meshes;
+    std::vector<std::unique_ptr<BVH> >                m_bvhs;
+    std::vector<std::unique_ptr<WideBVH> >            m_wide_bvhs;
+    std::vector<Instance>                             m_instances;
+    std::vector<std::pair<int, int> >                 m_emissive_faces; // face, instance
+
+    std::vector<Node, aligned_allocator<Node, 64> >   m_nodes;
+    std::vector<int>                                  m_instance_indices;
+
+    bool             m_use_wide_bvh;
+    BVH::BuildMethod m_bvh_method;
+    BVH::NodeLayout  m_bvh_layout;
+    float            m_split_budget;
+    std::string      m_bvh_cache;
+
+    void build_node(int current_node, int start_index, int end_index, int depth);
+    Hit  intersect_instance(int instance_id, ray &r, float &t_max, TraversalStats *stats);
+    bool visibility_instance(int instance_id, ray &r, float t_max, TraversalStats *stats, Hit *occluder);
+};
+
+#endif // SCENE_H
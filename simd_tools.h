@@ -0,0 +1,82 @@
+#ifndef SIMD_TOOLS_H
+#define SIMD_TOOLS_H
+
+#include <cstdint>
+#include <cstring>
+
+#include <immintrin.h>
+
+// 8 float lanes with AVX, 4 with SSE
+#ifdef __AVX__
+#define SIMD_WIDTH 8
+#else
+#define SIMD_WIDTH 4
+#endif
+
+#if SIMD_WIDTH == 8
+typedef __m256 vfloat;
+
+#define v_set1     _mm256_set1_ps
+#define v_load     _mm256_load_ps
+#define v_store    _mm256_store_ps
+#define v_add      _mm256_add_ps
+#define v_sub      _mm256_sub_ps
+#define v_mul      _mm256_mul_ps
+#define v_div      _mm256_div_ps
+#define v_min      _mm256_min_ps
+#define v_max      _mm256_max_ps
+#define v_and      _mm256_and_ps
+#define v_andnot   _mm256_andnot_ps
+#define v_or       _mm256_or_ps
+#define v_lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define v_le(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define v_gt(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define v_mask     _mm256_movemask_ps
+#define v_load_i(p) _mm256_castsi256_ps(_mm256_load_si256((const __m256i*) (p)))
+#define v_set1_i(i) _mm256_castsi256_ps(_mm256_set1_epi32(i))
+#define v_store_i(p, a) _mm256_store_si256((__m256i*) (p), _mm256_castps_si256(a))
+#else
+typedef __m128 vfloat;
+
+#define v_set1     _mm_set1_ps
+#define v_load     _mm_load_ps
+#define v_store    _mm_store_ps
+#define v_add      _mm_add_ps
+#define v_sub      _mm_sub_ps
+#define v_mul      _mm_mul_ps
+#define v_div      _mm_div_ps
+#define v_min      _mm_min_ps
+#define v_max      _mm_max_ps
+#define v_and      _mm_and_ps
+#define v_andnot   _mm_andnot_ps
+#define v_or       _mm_or_ps
+#define v_lt(a, b) _mm_cmplt_ps(a, b)
+#define v_le(a, b) _mm_cmple_ps(a, b)
+#define v_gt(a, b) _mm_cmpgt_ps(a, b)
+#define v_mask     _mm_movemask_ps
+#define v_load_i(p) _mm_castsi128_ps(_mm_load_si128((const __m128i*) (p)))
+#define v_set1_i(i) _mm_castsi128_ps(_mm_set1_epi32(i))
+#define v_store_i(p, a) _mm_store_si128((__m128i*) (p), _mm_castps_si128(a))
+#endif
+
+// converts SIMD_WIDTH unsigned bytes to floats
+inline vfloat v_load_u8(const uint8_t *p)
+{
+    int lo;
+    std::memcpy(&lo, p, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i i32  = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lo), zero), zero);
+#if SIMD_WIDTH == 8
+    int hi;
+    std::memcpy(&hi, p + 4, 4);
+    __m128i i32_hi = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(hi), zero), zero);
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_cvtepi32_ps(i32)), _mm_cvtepi32_ps(i32_hi), 1);
+#else
+    return _mm_cvtepi32_ps(i32);
+#endif
+}
+
+// lanes of a where mask is set, of b elsewhere (no SSE4 blendv)
+inline vfloat v_select(vfloat mask, vfloat a, vfloat b) { return v_or(v_and(mask, a), v_andnot(mask, b)); }
+
+#endif // SIMD_TOOLS_H
@@ -0,0 +1,171 @@
+#include "bvh.h"
+
+// the boxes of both children against 4 rays of the stream; a lane enters a box
+// when its entry is within its t, with the NaN ordering of intersect_packet_bb.
+// Finished rays of an any-hit stream have a negative t and enter nothing
+static inline void intersect_stream_bbs(const AABB *bbs, const StreamRay *rays, const int *ids, int nb_ids,
+                                        int *masks, __m128 *t_enter)
+{
+    __m128 r[4], d[4];
+    for (int l = 0; l < 4; ++l)
+    {
+        const StreamRay &sr = rays[ids[std::min(l, nb_ids - 1)]];
+        r[l] = _mm_load_ps(sr.origin);
+        d[l] = _mm_load_ps(sr.inv_d);
+    }
+
+    // origin x, y, z and t, then inv_d x, y, z of the 4 rays
+    _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+    _MM_TRANSPOSE4_PS(d[0], d[1], d[2], d[3]);
+
+    int lanes = (1 << nb_ids) - 1;
+    for (int c = 0; c < 2; ++c)
+    {
+        const AABB &bb = bbs[c];
+        __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bb.mini.x), r[0]), d[0]);
+        __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bb.maxi.x), r[0]), d[0]);
+        __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bb.mini.y), r[1]), d[1]);
+        __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bb.maxi.y), r[1]), d[1]);
+        __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bb.mini.z), r[2]), d[2]);
+        __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bb.maxi.z), r[2]), d[2]);
+
+        __m128 t0 = _mm_max_ps(_mm_setzero_ps(), _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_min_ps(tz0, tz1)));
+        __m128 t1 = _mm_min_ps(r[3], _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_max_ps(tz0, tz1)));
+
+        t_enter[c] = t0;
+        masks[c]   = _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & lanes;
+    }
+}
+
+void BVH::intersect_stream(StreamRay *rays, int nb_rays, std::vector<int> &ids, TraversalStats *stats)
+{
+    trace_stream<false>(rays, nb_rays, ids, stats);
+}
+
+void BVH::occluded_stream(StreamRay *rays, int nb_rays, std::vector<int> &ids, TraversalStats *stats)
+{
+    trace_stream<true>(rays, nb_rays, ids, stats);
+}
+
+// the ids of the rays that enter a node are kept as a list in ids; at an inner
+// node the list is split into the lists of the children, which are visited in
+// the order most of the rays prefer. Lists of the nodes on the stack stay in
+// ids until the node and its sibling are done
+template <bool any_hit>
+void BVH::trace_stream(StreamRay *rays, int nb_rays, std::vector<int> &ids, TraversalStats *stats)
+{
+    const Node *nodes = node_data();
+
+    if (stats)
+        stats->nb_rays += nb_rays;
+
+    if (nb_rays == 0)
+        return;
+
+    struct StackEntry
+    {
+        int node;
+        int begin;
+        int count;
+        int end; // of the lists of the node and its sibling
+    };
+
+    StackEntry nodes_stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+
+    if (ids.size() < (size_t) (4 * nb_rays))
+        ids.resize(4 * nb_rays);
+
+    for (int k = 0; k < nb_rays; ++k)
+        ids[k] = k;
+
+    // the root is tested as the first child of a pair of itself
+    AABB root_bbs[2] = {nodes[0].aabb, nodes[0].aabb};
+    int count = 0;
+    for (int k = 0; k < nb_rays; k += 4)
+    {
+        int    masks[2];
+        __m128 t_enter[2];
+        intersect_stream_bbs(root_bbs, rays, &ids[k], std::min(4, nb_rays - k), masks, t_enter);
+        for (int m = masks[0]; m; m &= m - 1)
+            ids[nb_rays + count++] = ids[k + __builtin_ctz(m)];
+    }
+
+    if (count > 0)
+        nodes_stack[stack_size++] = {0, nb_rays, count, nb_rays + count};
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = nodes_stack[--stack_size];
+        const Node &c_node = nodes[entry.node];
+
+        if (stats)
+            stats->nb_nodes += entry.count;
+
+        if (c_node.is_leaf())
+        {
+            if (stats)
+                stats->nb_faces += (long long) c_node.count * entry.count;
+
+            for (int k = entry.begin; k < entry.begin + entry.count; ++k)
+            {
+                StreamRay &sr = rays[ids[k]];
+                if (sr.t < 0.0f)
+                    continue;
+
+                SimdRay simd_ray(ray(float3(sr.origin[0], sr.origin[1], sr.origin[2]), float3(sr.direction[0], sr.direction[1], sr.direction[2])));
+                if (any_hit)
+                {
+                    Hit hit = intersect_faces_ea(simd_ray, sr.t, entry.node);
+                    if (hit)
+                    {
+                        sr.face_id = hit.face_id;
+                        sr.t       = -1.0f;
+                    }
+                }
+                else
+                {
+                    Hit hit = intersect_faces(simd_ray, sr.t, entry.node);
+                    if (hit)
+                        sr.face_id = hit.face_id;
+                }
+            }
+            continue;
+        }
+
+        // both lists are written above the lists still on the stack
+        int top = entry.end;
+        if (ids.size() < (size_t) (top + 2 * entry.count))
+            ids.resize(2 * (top + 2 * entry.count));
+
+        const AABB bbs[2] = {nodes[c_node.offset].aabb, nodes[c_node.offset + 1].aabb};
+        int *lists[2]  = {&ids[top], &ids[top + entry.count]};
+        int  counts[2] = {0, 0};
+        int  votes     = 0;
+
+        for (int k = entry.begin; k < entry.begin + entry.count; k += 4)
+        {
+            int    masks[2];
+            __m128 t_enter[2];
+            intersect_stream_bbs(bbs, rays, &ids[k], std::min(4, entry.begin + entry.count - k), masks, t_enter);
+
+            votes += __builtin_popcount(masks[0] & masks[1] & _mm_movemask_ps(_mm_cmpgt_ps(t_enter[0], t_enter[1])));
+            votes -= __builtin_popcount(masks[0] & masks[1] & _mm_movemask_ps(_mm_cmplt_ps(t_enter[0], t_enter[1])));
+
+            for (int c = 0; c < 2; ++c)
+            {
+                for (int m = masks[c]; m; m &= m - 1)
+                    lists[c][counts[c]++] = ids[k + __builtin_ctz(m)];
+            }
+        }
+
+        // pushed last is visited first, the right child when most rays enter it first
+        int end   = top + entry.count + counts[1];
+        int first = votes > 0 ? 1 : 0;
+        for (int c = 1 - first, n = 0; n < 2; c = 1 - c, ++n)
+        {
+            if (counts[c] > 0)
+                nodes_stack[stack_size++] = {c_node.offset + c, top + c * entry.count, counts[c], end};
+        }
+    }
+}
@@ -0,0 +1,139 @@
+#include <algorithm>
+
+#include "task_pool.h"
+
+static thread_local const TaskPool *current_pool  = nullptr;
+static thread_local int             current_index = 0;
+
+TaskPool::TaskPool(int nb_threads) : m_nb_queued(0), m_stop(false)
+{
+    if (nb_threads <= 0)
+        nb_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 0; i < nb_threads + 1; ++i)
+        m_queues.push_back(std::unique_ptr<Queue>(new Queue()));
+
+    for (int i = 0; i < nb_threads; ++i)
+        m_workers.push_back(std::thread(&TaskPool::worker, this, i));
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sleep_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+
+    for (auto &w : m_workers)
+        w.join();
+}
+
+TaskPool& TaskPool::global(void)
+{
+    static TaskPool pool;
+    return pool;
+}
+
+int TaskPool::thread_index(void) const
+{
+    return current_pool == this ? current_index : nb_threads();
+}
+
+void TaskPool::push(Task task)
+{
+    Queue &queue = *m_queues[thread_index()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    m_nb_queued++;
+
+    // taking the lock orders this wake up after a worker's check of m_nb_queued
+    {
+        std::lock_guard<std::mutex> lock(m_sleep_mutex);
+    }
+    m_wake.notify_one();
+}
+
+bool TaskPool::run_one(int thread_index)
+{
+    Task task;
+    int  nb_queues = m_queues.size();
+
+    // newest task of our own queue first, then the oldest one of the others
+    for (int k = 0; k < nb_queues && !task; ++k)
+    {
+        Queue &queue = *m_queues[(thread_index + k) % nb_queues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            continue;
+
+        if (k == 0)
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+
+    if (!task)
+        return false;
+
+    m_nb_queued--;
+    task();
+    return true;
+}
+
+void TaskPool::worker(int thread_index)
+{
+    current_pool  = this;
+    current_index = thread_index;
+
+    while (true)
+    {
+        if (run_one(thread_index))
+            continue;
+
+        std::unique_lock<std::mutex> lock(m_sleep_mutex);
+        m_wake.wait(lock, [this]() { return m_stop || m_nb_queued > 0; });
+        if (m_stop)
+            return;
+    }
+}
+
+void TaskPool::parallel_for(int begin, int end, int grain_size, const std::function<void(int, int)> &body)
+{
+    grain_size = std::max(grain_size, 1);
+
+    TaskGroup group(*this);
+    for (int b = begin; b < end; b += grain_size)
+    {
+        int e = std::min(b + grain_size, end);
+        group.run([&body, b, e]() { body(b, e); });
+    }
+    group.wait();
+}
+
+void TaskGroup::run(TaskPool::Task task)
+{
+    m_pending++;
+    m_pool.push([this, task]() {
+        task();
+        m_pending--;
+    });
+}
+
+void TaskGroup::wait(void)
+{
+    int thread_index = m_pool.thread_index();
+    while (m_pending > 0)
+    {
+        if (!m_pool.run_one(thread_index))
+            std::this_thread::yield();
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Fixed-size pool of worker threads with one task deque per thread: a thread
+// pops its own most recent tasks and steals the oldest ones of the others.
+// Threads waiting on a TaskGroup run pending tasks instead of blocking, so
+// tasks can spawn and wait for subtasks recursively.
+class TaskPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    // nb_threads = 0 uses one worker per hardware thread
+    explicit TaskPool(int nb_threads = 0);
+    ~TaskPool();
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    // process-wide pool sized to the hardware
+    static TaskPool& global(void);
+
+    inline int nb_threads(void) const { return m_workers.size(); }
+
+    // index of the calling worker, nb_threads() for threads outside the pool
+    int thread_index(void) const;
+
+    // splits [begin, end) in blocks of grain_size items run as tasks, returns once all are done
+    void parallel_for(int begin, int end, int grain_size, const std::function<void(int, int)> &body);
+
+private:
+    friend class TaskGroup;
+
+    struct Queue
+    {
+        std::mutex      mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::thread>             m_workers;
+    std::vector<std::unique_ptr<Queue> > m_queues; // one per worker, plus one shared by outside threads
+
+    std::mutex              m_sleep_mutex;
+    std::condition_variable m_wake;
+    std::atomic<int>        m_nb_queued;
+    std::atomic<bool>       m_stop;
+
+    void push(Task task);
+    bool run_one(int thread_index);
+    void worker(int thread_index);
+};
+
+class TaskGroup
+{
+public:
+    TaskGroup(TaskPool &pool = TaskPool::global()) : m_pool(pool), m_pending(0) {}
+    ~TaskGroup() { wait(); }
+
+    void run(TaskPool::Task task);
+    void wait(void);
+
+private:
+    TaskPool        &m_pool;
+    std::atomic<int> m_pending;
+};
+
+#endif // TASK_POOL_H
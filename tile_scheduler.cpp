@@ -0,0 +1,167 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+
+#include "tile_scheduler.h"
+#include "time_tools.h"
+
+static inline uint32_t expand_bits_2d(uint32_t x)
+{
+    x &= 0xffff;
+    x = (x | x << 8) & 0x00ff00ff;
+    x = (x | x << 4) & 0x0f0f0f0f;
+    x = (x | x << 2) & 0x33333333;
+    x = (x | x << 1) & 0x55555555;
+    return x;
+}
+
+// distance of (x, y) along the Hilbert curve filling a n x n grid, n a power of two
+static uint32_t hilbert_index(uint32_t n, uint32_t x, uint32_t y)
+{
+    uint32_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2)
+    {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+
+        // rotates the quadrant so that the sub-curve starts and ends where it should
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+TileScheduler::TileScheduler(int height, int width, int tile_size, Order order) : m_nb_threads(0), m_run_time(0.0)
+{
+    tile_size = std::max(tile_size, 1);
+
+    int nb_tile_rows = (height + tile_size - 1) / tile_size;
+    int nb_tile_cols = (width  + tile_size - 1) / tile_size;
+
+    uint32_t n = 1;
+    while (n < (uint32_t) std::max(nb_tile_rows, nb_tile_cols))
+        n *= 2;
+
+    std::vector<std::pair<uint64_t, int> > keys;
+    for (int ti = 0; ti < nb_tile_rows; ++ti)
+    {
+        for (int tj = 0; tj < nb_tile_cols; ++tj)
+        {
+            uint64_t key = keys.size();
+            if (order == MORTON)
+                key = expand_bits_2d(ti) << 1 | expand_bits_2d(tj);
+            else if (order == HILBERT)
+                key = hilbert_index(n, tj, ti);
+
+            keys.push_back(std::make_pair(key, (int) keys.size()));
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+
+    for (auto &k : keys)
+    {
+        Tile tile;
+        tile.i0 = (k.second / nb_tile_cols) * tile_size;
+        tile.j0 = (k.second % nb_tile_cols) * tile_size;
+        tile.i1 = std::min(tile.i0 + tile_size, height);
+        tile.j1 = std::min(tile.j0 + tile_size, width);
+        m_tiles.push_back(tile);
+    }
+}
+
+void TileScheduler::run(const std::function<void(const Tile&, int)> &body, TaskPool &pool)
+{
+    int nb_tiles = m_tiles.size();
+    int nb_runs  = pool.nb_threads();
+
+    m_nb_threads = pool.nb_threads() + 1;
+    m_tile_times.assign(nb_tiles, 0.0);
+    m_tile_threads.assign(nb_tiles, -1);
+
+    Timer timer;
+    TaskGroup group(pool);
+
+    // each seed task queues its run of tiles on the thread that picks it up, in
+    // reverse since a thread runs its newest tasks first and others steal the oldest
+    for (int r = 0; r < nb_runs; ++r)
+    {
+        int begin = (long long) nb_tiles *  r      / nb_runs;
+        int end   = (long long) nb_tiles * (r + 1) / nb_runs;
+
+        group.run([this, &group, &pool, &body, begin, end]() {
+            for (int t = end - 1; t >= begin; --t)
+            {
+                group.run([this, &pool, &body, t]() {
+                    int thread_index = pool.thread_index();
+
+                    Timer tile_timer;
+                    body(m_tiles[t], thread_index);
+
+                    m_tile_times[t]   = tile_timer.elapsed();
+                    m_tile_threads[t] = thread_index;
+                });
+            }
+        });
+    }
+    group.wait();
+
+    m_run_time = timer.elapsed();
+}
+
+void TileScheduler::print_stats(void) const
+{
+    if (m_tile_times.empty())
+        return;
+
+    std::vector<double> busy(m_nb_threads, 0.0);
+    double mini = 1e32, maxi = 0.0, sum = 0.0;
+    for (size_t t = 0; t < m_tile_times.size(); ++t)
+    {
+        mini = std::min(mini, m_tile_times[t]);
+        maxi = std::max(maxi, m_tile_times[t]);
+        sum += m_tile_times[t];
+        busy[m_tile_threads[t]] += m_tile_times[t];
+    }
+
+    // threads that ran no tile, like an outside thread that only waited, are left out
+    double busy_min = 1e32, busy_max = 0.0;
+    for (double b : busy)
+    {
+        if (b > 0.0)
+        {
+            busy_min = std::min(busy_min, b);
+            busy_max = std::max(busy_max, b);
+        }
+    }
+
+    std::cout << "tiles | " << m_tiles.size() << " tiles | "
+              << mini / 1000.0 << " / " << sum / m_tiles.size() / 1000.0 << " / " << maxi / 1000.0 << " ms min / mean / max per tile | "
+              << busy_min / 1000.0 << " to " << busy_max / 1000.0 << " ms busy per thread in " << m_run_time / 1000.0 << " ms" << std::endl;
+}
+
+void TileScheduler::save_stats(const std::string &file_path) const
+{
+    std::ofstream file(file_path);
+    if (!file)
+    {
+        std::cout << "cannot write tile timings to " << file_path << std::endl;
+        return;
+    }
+
+    file << "order,i0,j0,i1,j1,thread,microseconds" << std::endl;
+    for (size_t t = 0; t < m_tiles.size(); ++t)
+    {
+        const Tile &tile = m_tiles[t];
+        file << t << "," << tile.i0 << "," << tile.j0 << "," << tile.i1 << "," << tile.j1 << ","
+             << m_tile_threads[t] << "," << m_tile_times[t] << std::endl;
+    }
+}
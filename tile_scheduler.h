@@ -0,0 +1,52 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "task_pool.h"
+
+// pixels on a side of a tile, a multiple of the ray packet sizes keeps the packets full
+#define TILE_SIZE 32
+
+// pixels [i0, i1) x [j0, j1) of the image
+struct Tile
+{
+    int i0, j0;
+    int i1, j1;
+
+    inline int nb_pixels(void) const { return (i1 - i0) * (j1 - j0); }
+};
+
+// Splits the image in tiles ordered along a space-filling curve and renders
+// them on a TaskPool. Each thread starts on its own run of consecutive tiles,
+// which keeps its rays coherent, and steals tiles from the end of the runs of
+// the others once it is done, so uneven tiles do not leave threads idle.
+class TileScheduler
+{
+public:
+    enum Order {SCANLINE, MORTON, HILBERT};
+
+    TileScheduler() {}
+    TileScheduler(int height, int width, int tile_size = TILE_SIZE, Order order = HILBERT);
+
+    // calls body(tile, thread_index) once per tile, thread_index is below pool.nb_threads() + 1
+    void run(const std::function<void(const Tile&, int)> &body, TaskPool &pool = TaskPool::global());
+
+    inline int         nb_tiles(void)    const { return m_tiles.size(); }
+    inline const Tile& tile(int t)       const { return m_tiles[t];     }
+
+    // timings of the last run: a summary of the imbalance, and one line per tile as csv
+    void print_stats(void) const;
+    void save_stats(const std::string &file_path) const;
+
+private:
+    std::vector<Tile>   m_tiles;
+    std::vector<double> m_tile_times;   // microseconds
+    std::vector<int>    m_tile_threads;
+    int                 m_nb_threads;
+    double              m_run_time;
+};
+
+#endif // TILE_SCHEDULER_H
@@ -0,0 +1,285 @@
+#include "renderer.h"
+
+// pixel of path p in its tile, each run of RAY_PACKET_SIZE paths covers a packet-sized block
+static inline void path_pixel(int p, int &di, int &dj)
+{
+    int block         = p / RAY_PACKET_SIZE;
+    int lane          = p % RAY_PACKET_SIZE;
+    int nb_block_cols = WAVEFRONT_TILE_SIZE / RAY_PACKET_WIDTH;
+
+    di = (block / nb_block_cols) * RAY_PACKET_HEIGHT + lane / RAY_PACKET_WIDTH;
+    dj = (block % nb_block_cols) * RAY_PACKET_WIDTH  + lane % RAY_PACKET_WIDTH;
+}
+
+static inline float3 load3(const float v[3][WAVEFRONT_NB_PATHS], int p) { return float3(v[0][p], v[1][p], v[2][p]); }
+
+static inline void store3(float v[3][WAVEFRONT_NB_PATHS], int p, const float3 &x)
+{
+    v[0][p] = x.x;
+    v[1][p] = x.y;
+    v[2][p] = x.z;
+}
+
+// the paths of each WAVEFRONT_TILE_SIZE part of a tile advance one bounce at a
+// time through separate stages, each tracing its whole queue at once
+void Renderer::render_wavefront(TileScheduler &scheduler, int first_sample, int nb_samples)
+{
+    int nb_threads = TaskPool::global().nb_threads() + 1;
+
+    std::vector<ShadowCache,    aligned_allocator<ShadowCache, 64> >    shadows(nb_threads);
+    std::vector<WavefrontPaths, aligned_allocator<WavefrontPaths, 32> > paths(nb_threads);
+
+    scheduler.run([&](const Tile &tile, int thread_index) {
+        TraversalStats stats;
+        long long      nb_pixel_samples = 0;
+
+        for (int i0 = tile.i0; i0 < tile.i1; i0 += WAVEFRONT_TILE_SIZE)
+        {
+            for (int j0 = tile.j0; j0 < tile.j1; j0 += WAVEFRONT_TILE_SIZE)
+            {
+                Tile part = {i0, j0, std::min(i0 + WAVEFRONT_TILE_SIZE, tile.i1), std::min(j0 + WAVEFRONT_TILE_SIZE, tile.j1)};
+                nb_pixel_samples += render_wavefront_tile(part, first_sample, nb_samples, paths[thread_index], stats, shadows[thread_index]);
+            }
+        }
+
+        m_stats.add(thread_index, nb_pixel_samples, stats);
+    });
+}
+
+// returns the number of pixel samples traced, the blocks that converged are left out
+int Renderer::render_wavefront_tile(const Tile &tile, int first_sample, int nb_samples, WavefrontPaths &paths, TraversalStats &stats, ShadowCache &shadows)
+{
+    int nb_pixel_samples = 0;
+
+    for (int c = 0; c < 3; ++c)
+        std::fill(paths.radiance_sum[c], paths.radiance_sum[c] + WAVEFRONT_NB_PATHS, 0.0f);
+    std::fill(paths.luminance_sq, paths.luminance_sq + WAVEFRONT_NB_PATHS, 0.0f);
+
+    for (int si = first_sample; si < first_sample + nb_samples; ++si)
+    {
+        wavefront_generate(paths, tile, si);
+        nb_pixel_samples += paths.nb_extend;
+
+        for (int sp = 0; sp < m_max_nb_bounces && paths.nb_extend > 0; ++sp)
+        {
+            wavefront_extend(paths, sp, stats);
+            wavefront_shade(paths, tile, si, sp);
+            wavefront_shadow(paths, shadows, stats);
+        }
+
+        for (int p = 0; p < WAVEFRONT_NB_PATHS; ++p)
+        {
+            float3 radiance = load3(paths.radiance, p);
+            store3(paths.radiance_sum, p, load3(paths.radiance_sum, p) + radiance);
+            paths.luminance_sq[p] += luminance(radiance) * luminance(radiance);
+        }
+    }
+
+    for (int p = 0; p < WAVEFRONT_NB_PATHS; ++p)
+    {
+        int di, dj;
+        path_pixel(p, di, dj);
+
+        int i = tile.i0 + di;
+        int j = tile.j0 + dj;
+        if (i >= tile.i1 || j >= tile.j1)
+            continue;
+
+        m_accumulation[i * m_width + j] += load3(paths.radiance_sum, p);
+        m_luminance_sq[i * m_width + j] += paths.luminance_sq[p];
+    }
+
+    return nb_pixel_samples;
+}
+
+// camera rays of the pixels of the tile
+void Renderer::wavefront_generate(WavefrontPaths &paths, const Tile &tile, int sample_id)
+{
+    float focal = m_height * m_camera->focal();
+
+    paths.nb_extend = 0;
+
+    for (int c = 0; c < 3; ++c)
+        std::fill(paths.radiance[c], paths.radiance[c] + WAVEFRONT_NB_PATHS, 0.0f);
+
+    for (int p = 0; p < WAVEFRONT_NB_PATHS; ++p)
+    {
+        int di, dj;
+        path_pixel(p, di, dj);
+
+        int i = tile.i0 + di;
+        int j = tile.j0 + dj;
+        if (i >= tile.i1 || j >= tile.j1 || !block_active(i, j))
+            continue;
+
+        float dx = m_sampler.get_sample(sample_id, i, j, 0);
+        float dy = m_sampler.get_sample(sample_id, i, j, 1);
+
+        float3 direction;
+        direction.x = (j + dx - 0.5f * m_width)  / focal;
+        direction.y = (0.5f * m_height - i - dy) / focal;
+        direction.z = -1.0f;
+        direction.normalize();
+
+        direction = m_camera->orientation().dot(direction);
+
+        store3(paths.origin,     p, m_camera->position());
+        store3(paths.direction,  p, direction);
+        store3(paths.throughput, p, float3(1.0f));
+
+        paths.extend_queue[paths.nb_extend++] = p;
+    }
+}
+
+// closest hits of the queued paths, the camera rays of a block go as a packet
+// and the later bounces as one stream
+void Renderer::wavefront_extend(WavefrontPaths &paths, int sp, TraversalStats &stats)
+{
+    paths.nb_shade = 0;
+
+    if (sp > 0 && use_ray_streams())
+    {
+        for (int q = 0; q < paths.nb_extend; ++q)
+        {
+            int p = paths.extend_queue[q];
+            paths.stream[q].set(ray(load3(paths.origin, p), load3(paths.direction, p)), 1e10f);
+        }
+
+        m_bvh.intersect_stream(paths.stream, paths.nb_extend, paths.stream_ids, &stats);
+
+        for (int q = 0; q < paths.nb_extend; ++q)
+        {
+            const StreamRay &sr = paths.stream[q];
+            if (sr.face_id >= 0)
+                wavefront_hit(paths, paths.extend_queue[q], Hit(true, sr.t, sr.face_id));
+        }
+        return;
+    }
+
+    if (sp > 0)
+    {
+        for (int q = 0; q < paths.nb_extend; ++q)
+        {
+            int   p     = paths.extend_queue[q];
+            float t_max = 1e10f;
+            ray   r(load3(paths.origin, p), load3(paths.direction, p));
+
+            Hit hit = intersect(r, t_max, stats);
+            if (hit)
+                wavefront_hit(paths, p, hit);
+        }
+        return;
+    }
+
+    int q = 0;
+    while (q < paths.nb_extend)
+    {
+        int block = paths.extend_queue[q] / RAY_PACKET_SIZE;
+
+        RayPacket packet;
+        float     t_max[RAY_PACKET_SIZE];
+        Hit       hits[RAY_PACKET_SIZE];
+
+        for (; q < paths.nb_extend && paths.extend_queue[q] / RAY_PACKET_SIZE == block; ++q)
+        {
+            int p = paths.extend_queue[q];
+            int k = p % RAY_PACKET_SIZE;
+            packet.set(k, ray(load3(paths.origin, p), load3(paths.direction, p)));
+            t_max[k] = 1e10f;
+        }
+
+        intersect_packet(packet, t_max, hits, stats);
+
+        for (int mask = packet.active; mask; mask &= mask - 1)
+        {
+            int k = __builtin_ctz(mask);
+            if (hits[k])
+                wavefront_hit(paths, block * RAY_PACKET_SIZE + k, hits[k]);
+        }
+    }
+}
+
+void Renderer::wavefront_hit(WavefrontPaths &paths, int p, const Hit &hit)
+{
+    paths.t[p]           = hit.t;
+    paths.face_id[p]     = hit.face_id;
+    paths.instance_id[p] = hit.instance_id;
+
+    paths.shade_queue[paths.nb_shade++] = p;
+}
+
+// emission, light sample and next segment of the paths that hit a face
+void Renderer::wavefront_shade(WavefrontPaths &paths, const Tile &tile, int sample_id, int sp)
+{
+    paths.nb_extend      = 0;
+    paths.nb_shadow_rays = 0;
+
+    for (int q = 0; q < paths.nb_shade; ++q)
+    {
+        int p = paths.shade_queue[q];
+
+        int di, dj;
+        path_pixel(p, di, dj);
+        int i = tile.i0 + di;
+        int j = tile.j0 + dj;
+
+        ray    r(load3(paths.origin, p), load3(paths.direction, p));
+        Hit    hit(true, paths.t[p], paths.face_id[p], paths.instance_id[p]);
+        float3 throughput = load3(paths.throughput, p);
+        float3 radiance   = load3(paths.radiance, p);
+
+        ShadowRay light_sample;
+        if (shade(r, hit, sp, sample_id, i, j, throughput, radiance, light_sample))
+        {
+            int s = paths.nb_shadow_rays++;
+            store3(paths.shadow_origin,       s, light_sample.r.origin);
+            store3(paths.shadow_direction,    s, light_sample.r.direction);
+            store3(paths.shadow_contribution, s, light_sample.contribution);
+            paths.shadow_t_max[s] = light_sample.t_max;
+            paths.shadow_path[s]  = p;
+        }
+
+        store3(paths.radiance, p, radiance);
+
+        if (sp + 1 >= m_max_nb_bounces || !russian_roulette(throughput, sp, sample_id, i, j))
+            continue;
+
+        store3(paths.origin,     p, r.origin);
+        store3(paths.direction,  p, r.direction);
+        store3(paths.throughput, p, throughput);
+
+        paths.extend_queue[paths.nb_extend++] = p;
+    }
+}
+
+void Renderer::wavefront_shadow(WavefrontPaths &paths, ShadowCache &shadows, TraversalStats &stats)
+{
+    if (use_ray_streams())
+    {
+        for (int s = 0; s < paths.nb_shadow_rays; ++s)
+            paths.stream[s].set(ray(load3(paths.shadow_origin, s), load3(paths.shadow_direction, s)), paths.shadow_t_max[s]);
+
+        stats.nb_shadow_rays += paths.nb_shadow_rays;
+        m_bvh.occluded_stream(paths.stream, paths.nb_shadow_rays, paths.stream_ids, &stats);
+
+        for (int s = 0; s < paths.nb_shadow_rays; ++s)
+        {
+            if (paths.stream[s].face_id >= 0)
+                continue;
+
+            int p = paths.shadow_path[s];
+            store3(paths.radiance, p, load3(paths.radiance, p) + load3(paths.shadow_contribution, s));
+        }
+        return;
+    }
+
+    for (int s = 0; s < paths.nb_shadow_rays; ++s)
+    {
+        ray r(load3(paths.shadow_origin, s), load3(paths.shadow_direction, s));
+        if (occluded(r, paths.shadow_t_max[s], shadows, stats))
+            continue;
+
+        int p = paths.shadow_path[s];
+        store3(paths.radiance, p, load3(paths.radiance, p) + load3(paths.shadow_contribution, s));
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <vector>
+
+#include "bvh.h"
+
+// pixels on a side of the parts of a tile traced together, a multiple of the packet sizes
+#define WAVEFRONT_TILE_SIZE 32
+#define WAVEFRONT_NB_PATHS  (WAVEFRONT_TILE_SIZE * WAVEFRONT_TILE_SIZE)
+
+// paths of one sample of a tile as structure of arrays. Path p traces pixel p
+// of the tile in packet-sized blocks, so that consecutive camera rays can be
+// intersected as packets; the later bounces and the shadow rays are too
+// incoherent for packets and go through the BVH as one stream per stage.
+// The stages loop over compacted queues of path ids.
+struct alignas(32) WavefrontPaths
+{
+    // current segment, then its closest hit
+    float origin[3][WAVEFRONT_NB_PATHS];
+    float direction[3][WAVEFRONT_NB_PATHS];
+    float t[WAVEFRONT_NB_PATHS];
+    int   face_id[WAVEFRONT_NB_PATHS];
+    int   instance_id[WAVEFRONT_NB_PATHS];
+
+    float throughput[3][WAVEFRONT_NB_PATHS];
+    float radiance[3][WAVEFRONT_NB_PATHS]; // of the current sample
+
+    // over the samples of the pass
+    float radiance_sum[3][WAVEFRONT_NB_PATHS];
+    float luminance_sq[WAVEFRONT_NB_PATHS];
+
+    // light samples of the shading stage, tested by the shadow stage
+    float shadow_origin[3][WAVEFRONT_NB_PATHS];
+    float shadow_direction[3][WAVEFRONT_NB_PATHS];
+    float shadow_t_max[WAVEFRONT_NB_PATHS];
+    float shadow_contribution[3][WAVEFRONT_NB_PATHS];
+    int   shadow_path[WAVEFRONT_NB_PATHS];
+    int   nb_shadow_rays;
+
+    int extend_queue[WAVEFRONT_NB_PATHS];
+    int shade_queue[WAVEFRONT_NB_PATHS];
+    int nb_extend, nb_shade;
+
+    // the bounces and the shadow rays traced as a stream, with its scratch ids
+    StreamRay        stream[WAVEFRONT_NB_PATHS];
+    std::vector<int> stream_ids;
+};
+
+#endif // WAVEFRONT_H
@@ -0,0 +1,251 @@
+#include <iostream>
+
+#include "wide_bvh.h"
+
+WideBVH::SimdRay::SimdRay(const ray &r)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        origin[i] = v_set1(r.origin.data[i]);
+        inv_d[i]  = v_set1(r.inv_d.data[i]);
+    }
+}
+
+WideBVH::WideBVH(BVH &bvh, Mesh *mesh) : m_mesh(mesh), m_indices(bvh.index_data(), bvh.index_data() + bvh.nb_indices())
+{
+    m_nodes.reserve(bvh.nb_nodes() / 2 + 1);
+
+    if (bvh.node(0).is_leaf())
+    {
+        m_nodes.push_back(Node());
+        for (int k = 0; k < WIDE_BVH_WIDTH; ++k)
+            m_nodes[0].count[k] = -1;
+        set_child(0, 0, bvh, 0);
+    }
+    else
+    {
+        collapse(bvh, 0);
+    }
+
+    std::cout << "wide BVH | " << m_nodes.size() << " nodes of width " << WIDE_BVH_WIDTH << std::endl;
+}
+
+int WideBVH::collapse(BVH &bvh, int bvh_node)
+{
+    int children[WIDE_BVH_WIDTH];
+    int nb_children = 0;
+
+    children[nb_children++] = bvh.node(bvh_node).offset;
+    children[nb_children++] = bvh.node(bvh_node).offset + 1;
+
+    // greedily open the inner child with the largest surface until the node is full
+    while (nb_children < WIDE_BVH_WIDTH)
+    {
+        int   best_k       = -1;
+        float best_surface = -1.0f;
+        for (int k = 0; k < nb_children; ++k)
+        {
+            auto &c = bvh.node(children[k]);
+            if (!c.is_leaf() && c.aabb.surface() > best_surface)
+            {
+                best_k       = k;
+                best_surface = c.aabb.surface();
+            }
+        }
+
+        if (best_k < 0)
+            break;
+
+        int c_id = children[best_k];
+        children[best_k]        = bvh.node(c_id).offset;
+        children[nb_children++] = bvh.node(c_id).offset + 1;
+    }
+
+    int node_id = m_nodes.size();
+    m_nodes.push_back(Node());
+
+    for (int k = 0; k < WIDE_BVH_WIDTH; ++k)
+    {
+        Node &node = m_nodes[node_id];
+        node.mini_x[k] = node.mini_y[k] = node.mini_z[k] = 0.0f;
+        node.maxi_x[k] = node.maxi_y[k] = node.maxi_z[k] = 0.0f;
+        node.child[k]  =  0;
+        node.count[k]  = -1;
+    }
+
+    for (int k = 0; k < nb_children; ++k)
+        set_child(node_id, k, bvh, children[k]);
+
+    return node_id;
+}
+
+void WideBVH::set_child(int node_id, int k, BVH &bvh, int bvh_node)
+{
+    auto &c = bvh.node(bvh_node);
+
+    int child, count;
+    if (c.is_leaf())
+    {
+        child = c.offset;
+        count = c.count;
+    }
+    else
+    {
+        child = collapse(bvh, bvh_node);
+        count = 0;
+    }
+
+    // collapse() may have reallocated m_nodes
+    Node &node = m_nodes[node_id];
+    node.mini_x[k] = c.aabb.mini.x;
+    node.mini_y[k] = c.aabb.mini.y;
+    node.mini_z[k] = c.aabb.mini.z;
+    node.maxi_x[k] = c.aabb.maxi.x;
+    node.maxi_y[k] = c.aabb.maxi.y;
+    node.maxi_z[k] = c.aabb.maxi.z;
+    node.child[k]  = child;
+    node.count[k]  = count;
+}
+
+int WideBVH::intersect_children(const Node &node, const SimdRay &r, float t_max, float *t_near)
+{
+    vfloat tx0 = v_mul(v_sub(v_load(node.mini_x), r.origin[0]), r.inv_d[0]);
+    vfloat tx1 = v_mul(v_sub(v_load(node.maxi_x), r.origin[0]), r.inv_d[0]);
+    vfloat ty0 = v_mul(v_sub(v_load(node.mini_y), r.origin[1]), r.inv_d[1]);
+    vfloat ty1 = v_mul(v_sub(v_load(node.maxi_y), r.origin[1]), r.inv_d[1]);
+    vfloat tz0 = v_mul(v_sub(v_load(node.mini_z), r.origin[2]), r.inv_d[2]);
+    vfloat tz1 = v_mul(v_sub(v_load(node.maxi_z), r.origin[2]), r.inv_d[2]);
+
+    // min/max return their second operand when either is NaN, keeping the slab
+    // values last lets a NaN ray fail the test instead of hitting every box
+    vfloat t_enter = v_max(v_set1(0.0f),  v_max(v_max(v_min(tx0, tx1), v_min(ty0, ty1)), v_min(tz0, tz1)));
+    vfloat t_exit  = v_min(v_set1(t_max), v_min(v_min(v_max(tx0, tx1), v_max(ty0, ty1)), v_max(tz0, tz1)));
+
+    v_store(t_near, t_enter);
+
+    // empty slots have count = -1, i.e. their sign bit set
+    return v_mask(v_le(t_enter, t_exit)) & ~v_mask(v_load_i(node.count));
+}
+
+Hit WideBVH::intersect(ray &r, float &t_max, TraversalStats *stats)
+{
+    Hit best_hit = Hit(false, 1e32f, -1);
+
+    if (stats)
+        stats->nb_rays++;
+
+    SimdRay sr(r);
+    alignas(32) float t_near[WIDE_BVH_WIDTH];
+
+    StackEntry nodes_stack[WIDE_BVH_STACK_SIZE];
+    int stack_size = 0;
+    nodes_stack[stack_size++] = {0, 0, 0.0f};
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = nodes_stack[--stack_size];
+
+        if (entry.t >= t_max)
+            continue;
+
+        if (stats)
+            stats->nb_nodes++;
+
+        if (entry.count > 0)
+        {
+            if (stats)
+                stats->nb_faces += entry.count;
+
+            for (int ii = entry.child; ii < entry.child + entry.count; ++ii)
+            {
+                int i = m_indices[ii];
+                auto trit = m_mesh->triangle(i).intersect(r);
+                if (trit.first && trit.second < t_max)
+                {
+                    best_hit = Hit(true, trit.second, i);
+                    t_max    = trit.second;
+                }
+            }
+            continue;
+        }
+
+        const Node &node = m_nodes[entry.child];
+        int mask = intersect_children(node, sr, t_max, t_near);
+
+        // sort the hit children front to back, the stack is then filled back to front
+        int order[WIDE_BVH_WIDTH];
+        int nb_hits = 0;
+        while (mask)
+        {
+            int k = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            int h = nb_hits++;
+            while (h > 0 && t_near[order[h - 1]] > t_near[k])
+            {
+                order[h] = order[h - 1];
+                --h;
+            }
+            order[h] = k;
+        }
+
+        for (int h = nb_hits - 1; h >= 0; --h)
+        {
+            int k = order[h];
+            nodes_stack[stack_size++] = {node.child[k], node.count[k], t_near[k]};
+        }
+    }
+
+    return best_hit;
+}
+
+bool WideBVH::visibility(ray &r, float t_max, TraversalStats *stats, Hit *occluder)
+{
+    if (stats)
+        stats->nb_rays++;
+
+    SimdRay sr(r);
+    alignas(32) float t_near[WIDE_BVH_WIDTH];
+
+    StackEntry nodes_stack[WIDE_BVH_STACK_SIZE];
+    int stack_size = 0;
+    nodes_stack[stack_size++] = {0, 0, 0.0f};
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = nodes_stack[--stack_size];
+
+        if (stats)
+            stats->nb_nodes++;
+
+        if (entry.count > 0)
+        {
+            if (stats)
+                stats->nb_faces += entry.count;
+
+            for (int ii = entry.child; ii < entry.child + entry.count; ++ii)
+            {
+                auto trit = m_mesh->triangle(m_indices[ii]).intersect(r);
+                if (trit.first && trit.second <= t_max)
+                {
+                    if (occluder)
+                        *occluder = Hit(true, trit.second, m_indices[ii]);
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        const Node &node = m_nodes[entry.child];
+        int mask = intersect_children(node, sr, t_max, t_near);
+
+        while (mask)
+        {
+            int k = __builtin_ctz(mask);
+            mask &= mask - 1;
+            nodes_stack[stack_size++] = {node.child[k], node.count[k], t_near[k]};
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,67 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "simd_tools.h"
+
+#define WIDE_BVH_WIDTH      SIMD_WIDTH
+#define WIDE_BVH_STACK_SIZE (64 * WIDE_BVH_WIDTH)
+
+#include <vector>
+
+#include "math_tools.h"
+#include "memory_tools.h"
+#include "geometry.h"
+#include "mesh.h"
+#include "bvh.h"
+
+// BVH4 (SSE) or BVH8 (AVX) collapsed from a binary BVH, child bounds are
+// stored as SoA so that all the children of a node are tested at once.
+class WideBVH
+{
+    struct alignas(32) Node
+    {
+        float mini_x[WIDE_BVH_WIDTH], mini_y[WIDE_BVH_WIDTH], mini_z[WIDE_BVH_WIDTH];
+        float maxi_x[WIDE_BVH_WIDTH], maxi_y[WIDE_BVH_WIDTH], maxi_z[WIDE_BVH_WIDTH];
+
+        // inner child: child = node index, count = 0
+        // leaf child:  child = first index in m_indices, count = nb of faces
+        // empty slot:  count = -1
+        int child[WIDE_BVH_WIDTH];
+        int count[WIDE_BVH_WIDTH];
+    };
+
+    // ray broadcast once to all the lanes
+    struct SimdRay
+    {
+        SimdRay(const ray &r);
+        vfloat origin[3];
+        vfloat inv_d[3];
+    };
+
+    struct StackEntry
+    {
+        int   child;
+        int   count;
+        float t;
+    };
+
+public:
+    WideBVH() {}
+    WideBVH(BVH &bvh, Mesh *mesh);
+
+    Hit  intersect(ray &r, float &t_max, TraversalStats *stats = nullptr);
+    bool visibility(ray &r, float t_max, TraversalStats *stats = nullptr, Hit *occluder = nullptr);
+
+    inline int nb_nodes(void) const { return m_nodes.size(); }
+
+private:
+    Mesh*                                           m_mesh;
+    std::vector<Node, aligned_allocator<Node, 32> > m_nodes;
+    std::vector<int>                                m_indices;
+
+    int  collapse(BVH &bvh, int bvh_node);
+    void set_child(int node, int k, BVH &bvh, int bvh_node);
+    int  intersect_children(const Node &node, const SimdRay &r, float t_max, float *t_near);
+};
+
+#endif // WIDE_BVH_H